@@ -0,0 +1,52 @@
+#include <iostream>
+#include <string>
+
+#include "../message_broker_coro.hpp"
+
+using namespace gs;
+
+// Sends many concurrent RPC requests from coroutines, all driven by the main
+// thread through MessageBroker::run().
+//
+// usage: coro_rpc_client [calls]
+
+static int done = 0;
+
+static coro::Task
+client(MessageBroker& broker, MessageBroker::Configuration cfg, int n)
+{
+  MessageBroker::Request req;
+  req.body() = std::to_string(n % 30);
+
+  // the task is dropped, so it catches its own exceptions
+  try {
+    auto response = co_await coro::call(broker, cfg, req);
+    if (response && response->ok()) {
+      done++;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "call " << n << ": " << e.what() << std::endl;
+  }
+}
+
+int
+main(int argc, char const* argv[])
+{
+  int calls = argc > 1 ? std::stoi(argv[1]) : 1000;
+
+  MessageBroker broker("localhost", 5672, "guest", "guest", "/");
+  MessageBroker::Configuration configuration;
+  configuration.routing_key = "rpc_queue";
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) {
+    client(broker, configuration, i);
+  }
+  broker.run();
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  std::cout << done << "/" << calls << " calls answered in " << elapsed.count()
+            << " s" << std::endl;
+  return 0;
+}
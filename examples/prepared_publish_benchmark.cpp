@@ -0,0 +1,57 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../message_broker.hpp"
+
+using namespace gs::amqp;
+
+// Compares AmqpChannel::basicPublish with an AmqpPreparedPublish for messages
+// that only differ in their correlation id.
+//
+// usage: prepared_publish_benchmark [messages] [body size]
+
+int
+main(int argc, char const* argv[])
+{
+  int messages = argc > 1 ? std::stoi(argv[1]) : 100000;
+  std::size_t body_size = argc > 2 ? std::stoul(argv[2]) : 256;
+
+  auto conn = AmqpConnection::createInstance();
+  conn->open("localhost", 5672);
+  conn->login("/", "guest", "guest", 131072);
+  auto channel = AmqpChannel::createInstance(conn);
+  channel->exchangeDeclare("bench.prepared", AmqpChannel::EXCHANGE_TYPE_FANOUT);
+
+  AmqpMessage msg;
+  msg.body() = std::string(body_size, 'x');
+  msg.properties().content_type = "application/json";
+  msg.properties().delivery_mode = 2u;
+  msg.properties().app_id = "prepared_publish_benchmark";
+  msg.properties().headers = AmqpTable{ { "tenant", "benchmark" } };
+
+  auto report = [&](const char* name, auto start) {
+    auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    std::cout << name << ": " << messages << " messages, " << elapsed
+              << " s, " << messages / elapsed << " msg/s" << std::endl;
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < messages; i++) {
+    msg.properties().correlation_id = std::to_string(i);
+    channel->basicPublish("bench.prepared", "", msg);
+  }
+  report("basicPublish", start);
+
+  auto prepared = AmqpPreparedPublish::createInstance(
+    channel, "bench.prepared", "", msg.properties());
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < messages; i++) {
+    prepared->publish(msg.body(), std::to_string(i));
+  }
+  report("AmqpPreparedPublish", start);
+
+  return 0;
+}
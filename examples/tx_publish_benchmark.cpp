@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../message_broker.hpp"
+
+using namespace gs::amqp;
+
+// Compares three ways of publishing groups of messages reliably:
+// - per message: basic.publish with publisher confirms, waiting for each one
+// - confirms: a whole group published, then one wait for its confirms
+// - transaction: a whole group published, then one tx.commit
+// and reports throughput and the mean latency of a group.
+//
+// usage: tx_publish_benchmark [groups] [group size] [body size]
+
+int
+main(int argc, char const* argv[])
+{
+  int groups = argc > 1 ? std::stoi(argv[1]) : 200;
+  int group_size = argc > 2 ? std::stoi(argv[2]) : 50;
+  std::size_t body_size = argc > 3 ? std::stoul(argv[3]) : 1024;
+
+  auto conn = AmqpConnection::createInstance();
+  conn->open("localhost", 5672);
+  conn->login("/", "guest", "guest", 131072);
+
+  auto setup = AmqpChannel::createInstance(conn);
+  setup->exchangeDeclare("bench.tx", AmqpChannel::EXCHANGE_TYPE_FANOUT);
+  // exclusive, so that it and its messages go away with the connection
+  setup->queueDeclare("bench.tx", false, false, true, true);
+  setup->queueBind("bench.tx", "bench.tx");
+
+  AmqpMessage msg;
+  msg.body() = std::string(body_size, 'x');
+  msg.properties().content_type = "application/octet-stream";
+  msg.properties().delivery_mode = 2u;
+  std::vector<AmqpPublication> group(group_size, { "bench.tx", "", msg });
+
+  auto run = [&](const char* name, auto&& publish) {
+    std::vector<double> latencies;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < groups; i++) {
+      auto begin = std::chrono::steady_clock::now();
+      publish();
+      latencies.push_back(std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - begin)
+                            .count());
+    }
+    auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    std::sort(latencies.begin(), latencies.end());
+    double mean = 0;
+    for (double latency : latencies) {
+      mean += latency / latencies.size();
+    }
+    std::cout << name << ": " << groups * group_size / elapsed
+              << " msg/s, group latency mean " << mean << " ms, p99 "
+              << latencies[latencies.size() * 99 / 100] << " ms" << std::endl;
+  };
+
+  auto confirmed = AmqpChannel::createInstance(conn);
+  confirmed->confirmSelect();
+  run("per message", [&]() {
+    for (const auto& publication : group) {
+      confirmed->basicPublish(
+        publication.exchange, publication.routing_key, publication.message);
+      confirmed->waitForConfirms();
+    }
+  });
+  run("confirms", [&]() {
+    confirmed->basicPublish(group);
+    confirmed->waitForConfirms();
+  });
+
+  auto transactional = AmqpChannel::createInstance(conn);
+  transactional->txSelect();
+  run("transaction", [&]() {
+    transactional->basicPublish(group);
+    transactional->txCommit();
+  });
+
+  return 0;
+}
@@ -1,13 +1,34 @@
 #include "message_broker.hpp"
+#include <algorithm>
+#include <array>
 #include <assert.h>
 #include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <exception>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <mutex>
+#include <poll.h>
 #include <rabbitmq-c/amqp.h>
 #include <rabbitmq-c/tcp_socket.h>
+#include <random>
+#include <set>
 #include <stdexcept>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <thread>
+#include <unistd.h>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
@@ -29,6 +50,70 @@ string_amqp_bytes(const std::string& x)
   return amqp_cstring_bytes(x.c_str());
 }
 
+static AmqpTable
+convert_from_amqp_table(const amqp_table_t& table);
+
+static std::optional<AmqpTableValue>
+convert_from_amqp_field_value(const amqp_field_value_t& v)
+{
+  switch (v.kind) {
+    case AMQP_FIELD_KIND_BOOLEAN:
+      return AmqpTableValue(bool(v.value.boolean));
+    case AMQP_FIELD_KIND_I8:
+      return AmqpTableValue(v.value.i8);
+    case AMQP_FIELD_KIND_U8:
+      return AmqpTableValue(v.value.u8);
+    case AMQP_FIELD_KIND_I16:
+      return AmqpTableValue(v.value.i16);
+    case AMQP_FIELD_KIND_U16:
+      return AmqpTableValue(v.value.u16);
+    case AMQP_FIELD_KIND_I32:
+      return AmqpTableValue(v.value.i32);
+    case AMQP_FIELD_KIND_U32:
+      return AmqpTableValue(v.value.u32);
+    case AMQP_FIELD_KIND_I64:
+      return AmqpTableValue(v.value.i64);
+    case AMQP_FIELD_KIND_U64:
+    case AMQP_FIELD_KIND_TIMESTAMP:
+      return AmqpTableValue(v.value.u64);
+    case AMQP_FIELD_KIND_F32:
+      return AmqpTableValue(v.value.f32);
+    case AMQP_FIELD_KIND_F64:
+      return AmqpTableValue(v.value.f64);
+    case AMQP_FIELD_KIND_UTF8:
+    case AMQP_FIELD_KIND_BYTES:
+      return AmqpTableValue(amqp_bytes_string(v.value.bytes));
+    case AMQP_FIELD_KIND_ARRAY: {
+      std::vector<AmqpTableValue> array;
+      for (int i = 0; i < v.value.array.num_entries; ++i) {
+        auto value = convert_from_amqp_field_value(v.value.array.entries[i]);
+        if (value.has_value())
+          array.push_back(value.value());
+      }
+      return AmqpTableValue(array);
+    }
+    case AMQP_FIELD_KIND_TABLE:
+      return AmqpTableValue(convert_from_amqp_table(v.value.table));
+    default:
+      // decimal and void have no AmqpTableValue counterpart
+      return std::nullopt;
+  }
+}
+
+static AmqpTable
+convert_from_amqp_table(const amqp_table_t& table)
+{
+  AmqpTable result;
+  for (int i = 0; i < table.num_entries; ++i) {
+    auto value = convert_from_amqp_field_value(table.entries[i].value);
+    if (value.has_value()) {
+      result.insert(AmqpTableEntry(amqp_bytes_string(table.entries[i].key),
+                                   value.value()));
+    }
+  }
+  return result;
+}
+
 static inline AmqpProperties
 convert_to_amqp_properties(const amqp_basic_properties_t& props)
 {
@@ -37,6 +122,8 @@ convert_to_amqp_properties(const amqp_basic_properties_t& props)
     properties.content_type = amqp_bytes_string(props.content_type);
   if (props._flags & AMQP_BASIC_CONTENT_ENCODING_FLAG)
     properties.content_encoding = amqp_bytes_string(props.content_encoding);
+  if (props._flags & AMQP_BASIC_HEADERS_FLAG)
+    properties.headers = convert_from_amqp_table(props.headers);
   if (props._flags & AMQP_BASIC_DELIVERY_MODE_FLAG)
     properties.delivery_mode = props.delivery_mode;
   if (props._flags & AMQP_BASIC_PRIORITY_FLAG)
@@ -51,6 +138,8 @@ convert_to_amqp_properties(const amqp_basic_properties_t& props)
     properties.message_id = amqp_bytes_string(props.message_id);
   if (props._flags & AMQP_BASIC_TIMESTAMP_FLAG)
     properties.timestamp = props.timestamp;
+  if (props._flags & AMQP_BASIC_TYPE_FLAG)
+    properties.type = amqp_bytes_string(props.type);
   if (props._flags & AMQP_BASIC_USER_ID_FLAG)
     properties.user_id = amqp_bytes_string(props.user_id);
   if (props._flags & AMQP_BASIC_APP_ID_FLAG)
@@ -60,8 +149,137 @@ convert_to_amqp_properties(const amqp_basic_properties_t& props)
   return properties;
 }
 
+/// Copies @p x into @p pool, for values that do not outlive the conversion.
+static amqp_bytes_t
+pool_amqp_bytes(const std::string& x, amqp_pool_t* pool)
+{
+  amqp_bytes_t bytes;
+  amqp_pool_alloc_bytes(pool, x.size(), &bytes);
+  if (!bytes.bytes && x.size() > 0) {
+    die("Out of memory while converting AMQP table");
+  }
+  memcpy(bytes.bytes, x.data(), x.size());
+  return bytes;
+}
+
+static amqp_table_t
+convert_to_amqp_table(const AmqpTable& table, amqp_pool_t* pool);
+
+static amqp_field_value_t
+convert_to_amqp_field_value(const AmqpTableValue& value, amqp_pool_t* pool)
+{
+  amqp_field_value_t v;
+  switch (value.getType()) {
+    case AmqpTableValue::VT_bool:
+      v.kind = AMQP_FIELD_KIND_BOOLEAN;
+      v.value.boolean = value.getBool();
+      break;
+    case AmqpTableValue::VT_int8:
+      v.kind = AMQP_FIELD_KIND_I8;
+      v.value.i8 = value.getInt8();
+      break;
+    case AmqpTableValue::VT_int16:
+      v.kind = AMQP_FIELD_KIND_I16;
+      v.value.i16 = value.getInt16();
+      break;
+    case AmqpTableValue::VT_int32:
+      v.kind = AMQP_FIELD_KIND_I32;
+      v.value.i32 = value.getInt32();
+      break;
+    case AmqpTableValue::VT_int64:
+      v.kind = AMQP_FIELD_KIND_I64;
+      v.value.i64 = value.getInt64();
+      break;
+    case AmqpTableValue::VT_float:
+      v.kind = AMQP_FIELD_KIND_F32;
+      v.value.f32 = value.getFloat();
+      break;
+    case AmqpTableValue::VT_double:
+      v.kind = AMQP_FIELD_KIND_F64;
+      v.value.f64 = value.getDouble();
+      break;
+    case AmqpTableValue::VT_string:
+      v.kind = AMQP_FIELD_KIND_UTF8;
+      v.value.bytes = pool_amqp_bytes(value.getString(), pool);
+      break;
+    case AmqpTableValue::VT_array: {
+      auto array = value.getArray();
+      v.kind = AMQP_FIELD_KIND_ARRAY;
+      v.value.array.num_entries = array.size();
+      v.value.array.entries = (amqp_field_value_t*)amqp_pool_alloc(
+        pool, array.size() * sizeof(amqp_field_value_t));
+      for (std::size_t i = 0; i < array.size(); ++i) {
+        v.value.array.entries[i] = convert_to_amqp_field_value(array[i], pool);
+      }
+      break;
+    }
+    case AmqpTableValue::VT_table:
+      v.kind = AMQP_FIELD_KIND_TABLE;
+      v.value.table = convert_to_amqp_table(value.getTable(), pool);
+      break;
+    case AmqpTableValue::VT_uint8:
+      v.kind = AMQP_FIELD_KIND_U8;
+      v.value.u8 = value.getUint8();
+      break;
+    case AmqpTableValue::VT_uint16:
+      v.kind = AMQP_FIELD_KIND_U16;
+      v.value.u16 = value.getUint16();
+      break;
+    case AmqpTableValue::VT_uint32:
+      v.kind = AMQP_FIELD_KIND_U32;
+      v.value.u32 = value.getUint32();
+      break;
+    case AmqpTableValue::VT_uint64:
+      v.kind = AMQP_FIELD_KIND_U64;
+      v.value.u64 = value.getUint64();
+      break;
+  }
+  return v;
+}
+
+/// Converts @p table to its rabbitmq-c form; all memory, including copies of
+/// the strings, is taken from @p pool and released with it.
+static amqp_table_t
+convert_to_amqp_table(const AmqpTable& table, amqp_pool_t* pool)
+{
+  if (table.empty())
+    return amqp_empty_table;
+
+  amqp_table_t new_table;
+  new_table.num_entries = table.size();
+  new_table.entries = (amqp_table_entry_t*)amqp_pool_alloc(
+    pool, table.size() * sizeof(amqp_table_entry_t));
+
+  amqp_table_entry_t* output_it = new_table.entries;
+
+  for (AmqpTable::const_iterator it = table.begin(); it != table.end();
+       ++it, ++output_it) {
+    output_it->key = pool_amqp_bytes(it->first, pool);
+    output_it->value = convert_to_amqp_field_value(it->second, pool);
+  }
+
+  return new_table;
+}
+
+/// Memory of the tables converted for a single method call.
+struct AmqpTablePool
+{
+  amqp_pool_t pool;
+
+  AmqpTablePool() { init_amqp_pool(&pool, 4096); }
+  ~AmqpTablePool() { empty_amqp_pool(&pool); }
+
+  amqp_table_t convert(const AmqpTable& table)
+  {
+    return convert_to_amqp_table(table, &pool);
+  }
+};
+
+/// Converts @p properties; `headers` are allocated from @p pool, the other
+/// fields point into @p properties which must outlive the result.
 inline static amqp_basic_properties_t
-convert_to_amqp_basic_properties(const AmqpProperties& properties)
+convert_to_amqp_basic_properties(const AmqpProperties& properties,
+                                 amqp_pool_t* pool)
 {
   amqp_basic_properties_t props;
   props._flags = 0;
@@ -75,6 +293,10 @@ convert_to_amqp_basic_properties(const AmqpProperties& properties)
     props.content_encoding =
       amqp_cstring_bytes(properties.content_encoding.value().c_str());
   }
+  if (properties.headers.has_value()) {
+    props._flags |= AMQP_BASIC_HEADERS_FLAG;
+    props.headers = convert_to_amqp_table(properties.headers.value(), pool);
+  }
   if (properties.delivery_mode.has_value()) {
     props._flags |= AMQP_BASIC_DELIVERY_MODE_FLAG;
     props.delivery_mode = properties.delivery_mode.value();
@@ -126,102 +348,12 @@ convert_to_amqp_basic_properties(const AmqpProperties& properties)
   return props;
 }
 
-static amqp_table_t
-convert_to_amqp_table(const AmqpTable& table)
-{
-  auto convert_to_amqp_field_value = [](const AmqpTableValue& value) {
-    amqp_field_value_t v;
-    switch (value.getType()) {
-      case AmqpTableValue::VT_bool:
-        v.kind = AMQP_FIELD_KIND_BOOLEAN;
-        v.value.boolean = value.getBool();
-        break;
-      case AmqpTableValue::VT_int8:
-        v.kind = AMQP_FIELD_KIND_I8;
-        v.value.i8 = value.getInt8();
-        break;
-      case AmqpTableValue::VT_int16:
-        v.kind = AMQP_FIELD_KIND_I16;
-        v.value.i16 = value.getInt16();
-        break;
-      case AmqpTableValue::VT_int32:
-        v.kind = AMQP_FIELD_KIND_I32;
-        v.value.i32 = value.getInt32();
-        break;
-      case AmqpTableValue::VT_int64:
-        v.kind = AMQP_FIELD_KIND_I64;
-        v.value.i64 = value.getInt64();
-        break;
-      case AmqpTableValue::VT_float:
-        v.kind = AMQP_FIELD_KIND_F32;
-        v.value.f32 = value.getFloat();
-        break;
-      case AmqpTableValue::VT_double:
-        v.kind = AMQP_FIELD_KIND_F64;
-        v.value.f64 = value.getDouble();
-        break;
-      case AmqpTableValue::VT_string:
-        v.kind = AMQP_FIELD_KIND_UTF8;
-        v.value.bytes = amqp_cstring_bytes(value.getString().c_str());
-        break;
-      case AmqpTableValue::VT_array:
-        break;
-      case AmqpTableValue::VT_table:
-        v.kind = AMQP_FIELD_KIND_TABLE;
-        v.value.table = convert_to_amqp_table(value.getTable());
-        break;
-      case AmqpTableValue::VT_uint8:
-        v.kind = AMQP_FIELD_KIND_U8;
-        v.value.u8 = value.getUint8();
-        break;
-      case AmqpTableValue::VT_uint16:
-        v.kind = AMQP_FIELD_KIND_U16;
-        v.value.u16 = value.getUint16();
-        break;
-      case AmqpTableValue::VT_uint32:
-        v.kind = AMQP_FIELD_KIND_U32;
-        v.value.u32 = value.getUint32();
-        break;
-      case AmqpTableValue::VT_uint64:
-        v.kind = AMQP_FIELD_KIND_U64;
-        v.value.u64 = value.getUint64();
-        break;
-    }
-    return v;
-  };
-
-  amqp_table_t new_table;
-  new_table.num_entries = table.size();
-  new_table.entries = new amqp_table_entry_t[table.size()];
-
-  amqp_table_entry_t* output_it = new_table.entries;
-
-  for (AmqpTable::const_iterator it = table.begin(); it != table.end();
-       ++it, ++output_it) {
-    output_it->key = amqp_cstring_bytes(it->first.c_str());
-    output_it->value = convert_to_amqp_field_value(it->second);
-  }
-
-  return new_table;
-}
-
-static void
-destroy_amqp_table_entries(amqp_table_t& table)
-{
-  if (table.num_entries > 0) {
-    for (int i = 0; i < table.num_entries; ++i) {
-      if (table.entries[i].value.kind == AMQP_FIELD_KIND_TABLE) {
-        destroy_amqp_table_entries(table.entries[i].value.value.table);
-      }
-    }
-    delete[] table.entries;
-  }
-}
-
 static bool
-checkConsumeMessageLibErr(int library_error,
-                          amqp_connection_state_t& connection,
-                          std::string& errorText)
+checkConsumeMessageLibErr(
+  int library_error,
+  amqp_connection_state_t& connection,
+  std::string& errorText,
+  const std::function<void(const amqp_frame_t&)>& unexpected)
 {
   switch (library_error) {
     case AMQP_STATUS_OK:
@@ -236,6 +368,8 @@ checkConsumeMessageLibErr(int library_error,
       // getLogger()->warn("wait frame res: code: {} error text: {}",
       //                   result,
       //                   amqp_error_string2(result));
+      if (result == AMQP_STATUS_OK)
+        unexpected(frame);
     }
       return true;
     default: {
@@ -280,6 +414,13 @@ AmqpTableValue::AmqpTableValue(const AmqpTableValue& l)
 {
 }
 
+AmqpTableValue&
+AmqpTableValue::operator=(const AmqpTableValue& l)
+{
+  m_impl.reset(new Impl(l.m_impl->m_value));
+  return *this;
+}
+
 AmqpTableValue::AmqpTableValue(bool value)
   : m_impl(new Impl(value))
 {
@@ -345,6 +486,16 @@ AmqpTableValue::AmqpTableValue(const std::string& value)
 {
 }
 
+AmqpTableValue::AmqpTableValue(const std::vector<AmqpTableValue>& value)
+  : m_impl(new Impl(value))
+{
+}
+
+AmqpTableValue::AmqpTableValue(const AmqpTable& value)
+  : m_impl(new Impl(value))
+{
+}
+
 AmqpTableValue::~AmqpTableValue() {}
 
 AmqpTableValue::ValueType
@@ -437,10 +588,186 @@ AmqpTableValue::getTable() const
   return std::get<AmqpTable>(m_impl->m_value);
 }
 
+AmqpBlob::~AmqpBlob() {}
+
+struct AmqpMessage::Deferred
+{
+  std::mutex mutex;
+  std::function<AmqpBlob::Ptr()> loader;
+  AmqpBlob::Ptr blob;
+  std::optional<std::string> body;
+
+  /// Loads the blob once, the caller holds `mutex`.
+  const AmqpBlob& load()
+  {
+    if (!blob)
+      blob = loader();
+    return *blob;
+  }
+};
+
 AmqpMessage::AmqpMessage() {}
 
 AmqpMessage::~AmqpMessage() {}
 
+std::string_view
+AmqpMessage::bodyView() const
+{
+  if (m_deferred) {
+    std::lock_guard<std::mutex> lock(m_deferred->mutex);
+    const auto& blob = m_deferred->load();
+    return std::string_view(blob.data(), blob.size());
+  }
+  return m_body;
+}
+
+void
+AmqpMessage::setBodyLoader(std::function<AmqpBlob::Ptr()> loader)
+{
+  m_deferred = std::make_shared<Deferred>();
+  m_deferred->loader = std::move(loader);
+  m_body.clear();
+}
+
+const std::string&
+AmqpMessage::deferredBody() const
+{
+  std::lock_guard<std::mutex> lock(m_deferred->mutex);
+  if (!m_deferred->body.has_value()) {
+    const auto& blob = m_deferred->load();
+    m_deferred->body.emplace(blob.data(), blob.size());
+  }
+  return m_deferred->body.value();
+}
+
+void
+AmqpMessage::detachBody()
+{
+  // copies may still read the shared body, so it is copied, not moved
+  m_body = deferredBody();
+  m_deferred.reset();
+}
+
+const char* AmqpBlobStore::HEADER = "x-claim-check";
+
+AmqpBlobStore::~AmqpBlobStore() {}
+
+/// A file mapped read-only
+class AmqpMappedBlob : public AmqpBlob
+{
+public:
+  AmqpMappedBlob(void* data, std::size_t size)
+    : m_data(data)
+    , m_size(size)
+  {
+  }
+
+  virtual ~AmqpMappedBlob()
+  {
+    if (m_size > 0)
+      munmap(m_data, m_size);
+  }
+
+  const char* data() const override { return (const char*)m_data; }
+  std::size_t size() const override { return m_size; }
+
+private:
+  void* m_data;
+  std::size_t m_size;
+};
+
+AmqpDirectoryBlobStore::AmqpDirectoryBlobStore(const std::string& path)
+  : m_path(path)
+{
+  if (mkdir(path.c_str(), 0755) && errno != EEXIST) {
+    die("Creating blob store %s: %s", path.c_str(), strerror(errno));
+  }
+}
+
+AmqpDirectoryBlobStore::~AmqpDirectoryBlobStore() {}
+
+std::string
+AmqpDirectoryBlobStore::put(const std::string& body)
+{
+  static thread_local std::mt19937_64 random{ std::random_device()() };
+  char reference[32];
+  snprintf(reference,
+           sizeof(reference),
+           "%016llx%08llx",
+           (unsigned long long)random(),
+           (unsigned long long)(random() & 0xffffffff));
+
+  // written under a temporary name, so a reader never maps a partial body
+  std::string path = m_path + "/" + reference;
+  std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    die("Writing blob %s: %s", temporary.c_str(), strerror(errno));
+  }
+  for (std::size_t written = 0; written < body.size();) {
+    ssize_t n = write(fd, body.data() + written, body.size() - written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      int error = errno;
+      ::close(fd);
+      unlink(temporary.c_str());
+      die("Writing blob %s: %s", temporary.c_str(), strerror(error));
+    }
+    written += n;
+  }
+  ::close(fd);
+  if (rename(temporary.c_str(), path.c_str())) {
+    die("Writing blob %s: %s", path.c_str(), strerror(errno));
+  }
+  return reference;
+}
+
+AmqpBlob::Ptr
+AmqpDirectoryBlobStore::get(const std::string& reference)
+{
+  // references come from messages, never let them leave the directory
+  if (reference.empty() || reference.find('/') != std::string::npos ||
+      reference[0] == '.') {
+    die("Invalid blob reference '%s'", reference.c_str());
+  }
+  std::string path = m_path + "/" + reference;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    die("Reading blob %s: %s", path.c_str(), strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    int error = errno;
+    ::close(fd);
+    die("Reading blob %s: %s", path.c_str(), strerror(error));
+  }
+  void* data = nullptr;
+  if (st.st_size > 0) {
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      int error = errno;
+      ::close(fd);
+      die("Mapping blob %s: %s", path.c_str(), strerror(error));
+    }
+  }
+  ::close(fd);
+  return std::make_shared<AmqpMappedBlob>(data, st.st_size);
+}
+
+void
+AmqpDirectoryBlobStore::remove(const std::string& reference)
+{
+  if (reference.empty() || reference.find('/') != std::string::npos ||
+      reference[0] == '.') {
+    die("Invalid blob reference '%s'", reference.c_str());
+  }
+  std::string path = m_path + "/" + reference;
+  if (unlink(path.c_str()) && errno != ENOENT) {
+    die("Removing blob %s: %s", path.c_str(), strerror(errno));
+  }
+}
+
 AmqpEnvelope::AmqpEnvelope(const AmqpMessage& message,
                            const std::string& consumer_tag,
                            const std::uint64_t delivery_tag,
@@ -461,6 +788,60 @@ AmqpEnvelope::~AmqpEnvelope() {}
 struct AmqpConnection::Impl
 {
   amqp_connection_state_t state;
+  /// the plain TCP socket opened by open()
+  amqp_socket_t* tcp_socket = nullptr;
+  /// see setTimeout(), in milliseconds; -1 waits indefinitely
+  int timeout = -1;
+  bool blocked = false;
+  std::function<void(bool, const std::string&)> on_blocked;
+
+  /// The socket to write frames to directly, bypassing rabbitmq-c. Only a
+  /// plain TCP socket can be written to that way: the bytes would skip the
+  /// encryption of any other. The broker takes these writes as traffic for
+  /// its heartbeat timeout; rabbitmq-c does not, at worst it sends a
+  /// heartbeat which was not needed.
+  int rawSocket(const char* context) const
+  {
+    if (!tcp_socket || amqp_get_socket(state) != tcp_socket)
+      die("%s: the connection is not a plain TCP one", context);
+    return amqp_socket_get_sockfd(tcp_socket);
+  }
+
+  /// The largest body fragment of a body frame: the negotiated frame_max
+  /// less the 8 bytes of frame header and end, or the rabbitmq-c default
+  /// when the broker set no limit.
+  std::size_t bodyFragment() const
+  {
+    int frame_max = amqp_get_frame_max(state);
+    if (frame_max <= 8)
+      frame_max = AMQP_DEFAULT_FRAME_SIZE;
+    return std::size_t(frame_max) - 8;
+  }
+
+  /// Tracks connection.blocked and connection.unblocked, which may be read
+  /// by any channel; returns whether @p frame was one of them.
+  bool handleFrame(const amqp_frame_t& frame)
+  {
+    if (frame.frame_type != AMQP_FRAME_METHOD || frame.channel != 0)
+      return false;
+    bool was_blocked = blocked;
+    std::string reason;
+    switch (frame.payload.method.id) {
+      case AMQP_CONNECTION_BLOCKED_METHOD:
+        reason = amqp_bytes_string(
+          ((amqp_connection_blocked_t*)frame.payload.method.decoded)->reason);
+        blocked = true;
+        break;
+      case AMQP_CONNECTION_UNBLOCKED_METHOD:
+        blocked = false;
+        break;
+      default:
+        return false;
+    }
+    if (on_blocked && blocked != was_blocked)
+      on_blocked(blocked, reason);
+    return true;
+  }
 };
 
 AmqpConnection::AmqpConnection()
@@ -471,11 +852,15 @@ AmqpConnection::AmqpConnection()
 
 AmqpConnection::~AmqpConnection()
 {
+  // errors are not thrown from here: the connection is gone either way
   if (m_impl->state) {
-    die_on_amqp_error(amqp_connection_close(m_impl->state, AMQP_REPLY_SUCCESS),
-                      "connection.close");
-    die_on_error(amqp_destroy_connection(m_impl->state), "connection.destroy");
+    // a blocked connection is not read by the broker, closing it would hang
+    if (!m_impl->blocked)
+      amqp_connection_close(m_impl->state, AMQP_REPLY_SUCCESS);
+    amqp_destroy_connection(m_impl->state);
   }
+  if (m_impl->blocked && m_impl->on_blocked)
+    m_impl->on_blocked(false, "");
 }
 
 void
@@ -489,6 +874,7 @@ AmqpConnection::open(const std::string& host, int port)
   if (status) {
     die("AMQP opening TCP socket on %s:%d failed", host.c_str(), port);
   }
+  m_impl->tcp_socket = socket;
 }
 
 void
@@ -497,21 +883,225 @@ AmqpConnection::login(const std::string& vhost,
                       const std::string& password,
                       int frame_max) const
 {
-  die_on_amqp_error(amqp_login(m_impl->state,
-                               vhost.c_str(),
-                               0,
-                               frame_max,
-                               0,
-                               AMQP_SASL_METHOD_PLAIN,
-                               username.c_str(),
-                               password.c_str()),
+  // merged by rabbitmq-c with the capabilities it advertises itself
+  AmqpTablePool pool;
+  amqp_table_t properties = pool.convert(AmqpTable{
+    { "capabilities",
+      AmqpTable{ { "connection.blocked", true },
+                 { "consumer_cancel_notify", true } } } });
+  die_on_amqp_error(amqp_login_with_properties(m_impl->state,
+                                               vhost.c_str(),
+                                               0,
+                                               frame_max,
+                                               0,
+                                               &properties,
+                                               AMQP_SASL_METHOD_PLAIN,
+                                               username.c_str(),
+                                               password.c_str()),
                     "Logging in");
 }
 
+int
+AmqpConnection::fd() const
+{
+  return amqp_get_sockfd(m_impl->state);
+}
+
+bool
+AmqpConnection::hasPending() const
+{
+  return amqp_frames_enqueued(m_impl->state) ||
+         amqp_data_in_buffer(m_impl->state);
+}
+
+int
+AmqpConnection::heartbeat() const
+{
+  return amqp_get_heartbeat(m_impl->state);
+}
+
+int
+AmqpConnection::frameMax() const
+{
+  return amqp_get_frame_max(m_impl->state);
+}
+
+void
+AmqpConnection::setSocketBuffers(int send, int receive)
+{
+  int fd = amqp_get_sockfd(m_impl->state);
+  int current = 0;
+  socklen_t length = sizeof(current);
+  if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &current, &length) == 0 &&
+      send > current)
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send, sizeof(send));
+  length = sizeof(current);
+  if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &current, &length) == 0 &&
+      receive > current)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive, sizeof(receive));
+}
+
+void
+AmqpConnection::setTimeout(std::chrono::milliseconds timeout)
+{
+  struct timeval tv = { time_t(timeout.count() / 1000),
+                        suseconds_t(timeout.count() % 1000 * 1000) };
+  die_on_error(amqp_set_rpc_timeout(m_impl->state, &tv), "Setting timeout");
+  m_impl->timeout = int(timeout.count());
+}
+
+bool
+AmqpConnection::blocked() const
+{
+  return m_impl->blocked;
+}
+
+void
+AmqpConnection::setBlockedHandler(
+  std::function<void(bool blocked, const std::string& reason)> handler)
+{
+  m_impl->on_blocked = std::move(handler);
+}
+
 struct AmqpChannel::Impl
 {
   amqp_connection_state_t state;
+  AmqpConnection::Impl* conn;
   amqp_channel_t channel;
+  bool closed = false;
+  /// why the broker closed the channel, when it did so between replies
+  std::string close_reason;
+  /// converted message headers, recycled on every publish
+  amqp_pool_t pool;
+  /// publisher confirms: delivery tag of the last message published since
+  /// confirm.select, the tags not confirmed yet, and whether one was nacked
+  /// since the last wait
+  bool confirms = false;
+  std::uint64_t published = 0;
+  std::set<std::uint64_t> unconfirmed;
+  bool nacked = false;
+  std::function<void(const AmqpReturn&)> on_return;
+  /// consumers cancelled by the broker
+  std::set<std::string> cancelled;
+
+  /// Counts published messages, whose delivery tags follow each other once
+  /// confirms are enabled.
+  void track(std::size_t count)
+  {
+    for (std::size_t i = 0; i < count; i++) {
+      published++;
+      if (confirms)
+        unconfirmed.insert(published);
+    }
+  }
+
+  /// Handles a basic.ack or basic.nack of publisher confirms, which with
+  /// `multiple` covers every tag up to @p delivery_tag.
+  void confirm(std::uint64_t delivery_tag, bool multiple, bool nack)
+  {
+    if (multiple)
+      unconfirmed.erase(unconfirmed.begin(),
+                        unconfirmed.upper_bound(delivery_tag));
+    else
+      unconfirmed.erase(delivery_tag);
+    nacked |= nack;
+  }
+
+  /// Checks the reply of the last synchronous method. A channel error from
+  /// the broker (possibly caused by an earlier `nowait` method) is answered
+  /// with channel.close-ok so the connection stays usable, then thrown.
+  void checkRpcReply(const char* context)
+  {
+    amqp_rpc_reply_t reply = amqp_get_rpc_reply(state);
+    if (reply.reply_type == AMQP_RESPONSE_SERVER_EXCEPTION &&
+        reply.reply.id == AMQP_CHANNEL_CLOSE_METHOD) {
+      amqp_channel_close_ok_t close_ok;
+      amqp_send_method(state, channel, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+      closed = true;
+    }
+    die_on_amqp_error(reply, context);
+  }
+
+  /// Throws for a method frame read in place of a reply, acknowledging it
+  /// first when the server closed the connection.
+  [[noreturn]] void unexpectedMethod(const amqp_frame_t& frame,
+                                     const char* context)
+  {
+    if (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD) {
+      auto close = (amqp_connection_close_t*)frame.payload.method.decoded;
+      std::string reason = amqp_bytes_string(close->reply_text);
+      amqp_connection_close_ok_t close_ok;
+      amqp_send_method(state, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &close_ok);
+      closed = true;
+      die("%s: server connection error %u, message: %s",
+          context,
+          close->reply_code,
+          reason.c_str());
+    }
+    die("%s: unexpected method 0x%08x", context, frame.payload.method.id);
+    abort();
+  }
+
+  /// Reads the message following a basic.return method frame and passes it
+  /// to `on_return`.
+  void handleReturn(const amqp_frame_t& frame)
+  {
+    auto method = (amqp_basic_return_t*)frame.payload.method.decoded;
+    AmqpReturn returned;
+    returned.reply_code = method->reply_code;
+    returned.reply_text = amqp_bytes_string(method->reply_text);
+    returned.exchange = amqp_bytes_string(method->exchange);
+    returned.routing_key = amqp_bytes_string(method->routing_key);
+
+    amqp_message_t content;
+    die_on_amqp_error(amqp_read_message(state, channel, &content, 0),
+                      "basic.return");
+    returned.message.body() = amqp_bytes_string(content.body);
+    returned.message.properties() =
+      convert_to_amqp_properties(content.properties);
+    amqp_destroy_message(&content);
+    if (on_return)
+      on_return(returned);
+  }
+
+  /// Handles the frames which may come in between others: returned messages,
+  /// consumer cancels, a close of the channel by the broker, which is
+  /// acknowledged so that the connection stays usable, and connection flow
+  /// control. Returns whether @p frame was one of them.
+  bool handleFrame(const amqp_frame_t& frame)
+  {
+    if (frame.frame_type == AMQP_FRAME_METHOD &&
+        frame.payload.method.id == AMQP_BASIC_RETURN_METHOD) {
+      handleReturn(frame);
+      return true;
+    }
+    if (frame.frame_type == AMQP_FRAME_METHOD && frame.channel == channel &&
+        frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD) {
+      auto close = (amqp_channel_close_t*)frame.payload.method.decoded;
+      close_reason = "server channel error " +
+                     std::to_string(close->reply_code) +
+                     ", message: " + amqp_bytes_string(close->reply_text);
+      amqp_channel_close_ok_t close_ok;
+      amqp_send_method(state, channel, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+      closed = true;
+      return true;
+    }
+    if (frame.frame_type == AMQP_FRAME_METHOD &&
+        frame.payload.method.id == AMQP_BASIC_CANCEL_METHOD) {
+      // sent by the broker with `nowait`, so not answered
+      auto cancel = (amqp_basic_cancel_t*)frame.payload.method.decoded;
+      cancelled.insert(amqp_bytes_string(cancel->consumer_tag));
+      return true;
+    }
+    return conn->handleFrame(frame);
+  }
+
+  /// Throws once the broker closed the channel, see handleFrame().
+  void checkOpen(const char* context)
+  {
+    if (closed)
+      die("%s: %s", context, close_reason.c_str());
+  }
 };
 
 const char* AmqpChannel::EXCHANGE_TYPE_DIRECT = "direct";
@@ -520,6 +1110,8 @@ const char* AmqpChannel::EXCHANGE_TYPE_FANOUT = "fanout";
 
 const char* AmqpChannel::EXCHANGE_TYPE_TOPIC = "topic";
 
+const char* AmqpChannel::EXCHANGE_TYPE_HEADERS = "headers";
+
 AmqpChannel::AmqpChannel(const AmqpConnection::Ptr conn)
   : m_impl(new Impl)
 {
@@ -531,17 +1123,34 @@ AmqpChannel::AmqpChannel(const AmqpConnection::Ptr conn)
   /// using amqp_simple_wait_frame, then provide your own logic to handle
   /// messages from different channels appropriately.
   m_impl->state = conn->m_impl->state;
+  m_impl->conn = conn->m_impl.get();
   m_impl->channel = 1u;
+  init_amqp_pool(&m_impl->pool, 4096);
 
   amqp_channel_open(m_impl->state, m_impl->channel);
-  die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "channel.open");
+  m_impl->checkRpcReply("channel.open");
 }
 
 AmqpChannel::~AmqpChannel()
 {
-  die_on_amqp_error(
-    amqp_channel_close(m_impl->state, m_impl->channel, AMQP_REPLY_SUCCESS),
-    "channel.close");
+  empty_amqp_pool(&m_impl->pool);
+  if (m_impl->closed || m_impl->conn->blocked)
+    return;
+  // errors are not thrown from here, e.g. when the connection was lost
+  amqp_channel_close(m_impl->state, m_impl->channel, AMQP_REPLY_SUCCESS);
+
+  // returns and flow control sent before close-ok were queued while
+  // waiting for it
+  while (amqp_frames_enqueued(m_impl->state)) {
+    amqp_frame_t frame;
+    if (amqp_simple_wait_frame(m_impl->state, &frame) != AMQP_STATUS_OK)
+      break;
+    try {
+      m_impl->handleFrame(frame);
+    } catch (const std::exception&) {
+      break;
+    }
+  }
 }
 
 void
@@ -561,7 +1170,7 @@ AmqpChannel::exchangeDeclare(const std::string& exchange_name,
                         auto_delete,
                         internal,
                         amqp_empty_table);
-  die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "exchange.declare");
+  m_impl->checkRpcReply("exchange.declare");
 }
 
 void
@@ -573,7 +1182,8 @@ AmqpChannel::exchangeDeclare(const std::string& exchange_name,
                              bool internal,
                              const AmqpTable& arguments)
 {
-  amqp_table_t args = convert_to_amqp_table(arguments);
+  AmqpTablePool pool;
+  amqp_table_t args = pool.convert(arguments);
   amqp_exchange_declare(m_impl->state,
                         m_impl->channel,
                         amqp_cstring_bytes(exchange_name.c_str()),
@@ -583,8 +1193,7 @@ AmqpChannel::exchangeDeclare(const std::string& exchange_name,
                         auto_delete,
                         internal,
                         args);
-  die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "exchange.declare");
-  destroy_amqp_table_entries(args);
+  m_impl->checkRpcReply("exchange.declare");
 }
 
 void
@@ -592,6 +1201,29 @@ AmqpChannel::exchangeBind(const std::string& destination,
                           const std::string& source,
                           const std::string& routing_key)
 {
+  amqp_exchange_bind(m_impl->state,
+                     m_impl->channel,
+                     amqp_cstring_bytes(destination.c_str()),
+                     amqp_cstring_bytes(source.c_str()),
+                     amqp_cstring_bytes(routing_key.c_str()),
+                     amqp_empty_table);
+  m_impl->checkRpcReply("exchange.bind");
+}
+
+void
+AmqpChannel::exchangeBind(const std::string& destination,
+                          const std::string& source,
+                          const std::string& routing_key,
+                          const AmqpTable& arguments)
+{
+  AmqpTablePool pool;
+  amqp_exchange_bind(m_impl->state,
+                     m_impl->channel,
+                     amqp_cstring_bytes(destination.c_str()),
+                     amqp_cstring_bytes(source.c_str()),
+                     amqp_cstring_bytes(routing_key.c_str()),
+                     pool.convert(arguments));
+  m_impl->checkRpcReply("exchange.bind");
 }
 
 void
@@ -599,6 +1231,39 @@ AmqpChannel::exchangeUnbind(const std::string& destination,
                             const std::string& source,
                             const std::string& routing_key)
 {
+  amqp_exchange_unbind(m_impl->state,
+                       m_impl->channel,
+                       amqp_cstring_bytes(destination.c_str()),
+                       amqp_cstring_bytes(source.c_str()),
+                       amqp_cstring_bytes(routing_key.c_str()),
+                       amqp_empty_table);
+  m_impl->checkRpcReply("exchange.unbind");
+}
+
+void
+AmqpChannel::exchangeUnbind(const std::string& destination,
+                            const std::string& source,
+                            const std::string& routing_key,
+                            const AmqpTable& arguments)
+{
+  AmqpTablePool pool;
+  amqp_exchange_unbind(m_impl->state,
+                       m_impl->channel,
+                       amqp_cstring_bytes(destination.c_str()),
+                       amqp_cstring_bytes(source.c_str()),
+                       amqp_cstring_bytes(routing_key.c_str()),
+                       pool.convert(arguments));
+  m_impl->checkRpcReply("exchange.unbind");
+}
+
+void
+AmqpChannel::exchangeDelete(const std::string& exchange_name, bool if_unused)
+{
+  amqp_exchange_delete(m_impl->state,
+                       m_impl->channel,
+                       amqp_cstring_bytes(exchange_name.c_str()),
+                       if_unused);
+  m_impl->checkRpcReply("exchange.delete");
 }
 
 std::string
@@ -617,7 +1282,7 @@ AmqpChannel::queueDeclare(const std::string& queue_name,
                        exclusive,
                        auto_delete,
                        amqp_empty_table);
-  die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "queue.declare");
+  m_impl->checkRpcReply("queue.declare");
   return std::string((char*)r->queue.bytes, r->queue.len);
 }
 
@@ -629,7 +1294,8 @@ AmqpChannel::queueDeclare(const std::string& queue_name,
                           bool auto_delete,
                           const AmqpTable& arguments)
 {
-  amqp_table_t args = convert_to_amqp_table(arguments);
+  AmqpTablePool pool;
+  amqp_table_t args = pool.convert(arguments);
   amqp_queue_declare_ok_t* r =
     amqp_queue_declare(m_impl->state,
                        m_impl->channel,
@@ -639,14 +1305,41 @@ AmqpChannel::queueDeclare(const std::string& queue_name,
                        exclusive,
                        auto_delete,
                        args);
-  die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "queue.declare");
-  destroy_amqp_table_entries(args);
+  m_impl->checkRpcReply("queue.declare");
   return std::string((char*)r->queue.bytes, r->queue.len);
 }
 
-void
-AmqpChannel::queueBind(const std::string& queue_name,
-                       const std::string& exchange_name,
+AmqpQueueStats
+AmqpChannel::queueStats(const std::string& queue_name)
+{
+  amqp_queue_declare_ok_t* r =
+    amqp_queue_declare(m_impl->state,
+                       m_impl->channel,
+                       amqp_cstring_bytes(queue_name.c_str()),
+                       true,
+                       false,
+                       false,
+                       false,
+                       amqp_empty_table);
+  m_impl->checkRpcReply("queue.declare");
+
+  AmqpQueueStats stats;
+  stats.name = amqp_bytes_string(r->queue);
+  stats.message_count = r->message_count;
+  stats.consumer_count = r->consumer_count;
+  stats.sampled = std::chrono::steady_clock::now();
+  return stats;
+}
+
+bool
+AmqpChannel::isOpen() const
+{
+  return !m_impl->closed;
+}
+
+void
+AmqpChannel::queueBind(const std::string& queue_name,
+                       const std::string& exchange_name,
                        const std::string& routing_key)
 {
   amqp_queue_bind(m_impl->state,
@@ -655,7 +1348,115 @@ AmqpChannel::queueBind(const std::string& queue_name,
                   amqp_cstring_bytes(exchange_name.c_str()),
                   amqp_cstring_bytes(routing_key.c_str()),
                   amqp_empty_table);
-  die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "queue.bind");
+  m_impl->checkRpcReply("queue.bind");
+}
+
+void
+AmqpChannel::queueBind(const std::string& queue_name,
+                       const std::string& exchange_name,
+                       const std::string& routing_key,
+                       const AmqpTable& arguments)
+{
+  AmqpTablePool pool;
+  amqp_queue_bind(m_impl->state,
+                  m_impl->channel,
+                  amqp_cstring_bytes(queue_name.c_str()),
+                  amqp_cstring_bytes(exchange_name.c_str()),
+                  amqp_cstring_bytes(routing_key.c_str()),
+                  pool.convert(arguments));
+  m_impl->checkRpcReply("queue.bind");
+}
+
+void
+AmqpChannel::exchangeDeclareNoWait(const std::string& exchange_name,
+                                   const std::string& exchange_type,
+                                   bool passive,
+                                   bool durable,
+                                   bool auto_delete,
+                                   bool internal,
+                                   const AmqpTable& arguments)
+{
+  amqp_exchange_declare_t req;
+  req.ticket = 0;
+  req.exchange = amqp_cstring_bytes(exchange_name.c_str());
+  req.type = amqp_cstring_bytes(exchange_type.c_str());
+  req.passive = passive;
+  req.durable = durable;
+  req.auto_delete = auto_delete;
+  req.internal = internal;
+  req.nowait = 1;
+  AmqpTablePool pool;
+  req.arguments = pool.convert(arguments);
+  die_on_error(
+    amqp_send_method(
+      m_impl->state, m_impl->channel, AMQP_EXCHANGE_DECLARE_METHOD, &req),
+    "exchange.declare");
+}
+
+void
+AmqpChannel::queueDeclareNoWait(const std::string& queue_name,
+                                bool passive,
+                                bool durable,
+                                bool exclusive,
+                                bool auto_delete,
+                                const AmqpTable& arguments)
+{
+  if (queue_name.empty()) {
+    die("queue.declare: nowait requires a queue name");
+  }
+  amqp_queue_declare_t req;
+  req.ticket = 0;
+  req.queue = amqp_cstring_bytes(queue_name.c_str());
+  req.passive = passive;
+  req.durable = durable;
+  req.exclusive = exclusive;
+  req.auto_delete = auto_delete;
+  req.nowait = 1;
+  AmqpTablePool pool;
+  req.arguments = pool.convert(arguments);
+  die_on_error(
+    amqp_send_method(
+      m_impl->state, m_impl->channel, AMQP_QUEUE_DECLARE_METHOD, &req),
+    "queue.declare");
+}
+
+void
+AmqpChannel::queueBindNoWait(const std::string& queue_name,
+                             const std::string& exchange_name,
+                             const std::string& routing_key,
+                             const AmqpTable& arguments)
+{
+  amqp_queue_bind_t req;
+  req.ticket = 0;
+  req.queue = amqp_cstring_bytes(queue_name.c_str());
+  req.exchange = amqp_cstring_bytes(exchange_name.c_str());
+  req.routing_key = amqp_cstring_bytes(routing_key.c_str());
+  req.nowait = 1;
+  AmqpTablePool pool;
+  req.arguments = pool.convert(arguments);
+  die_on_error(amqp_send_method(
+                 m_impl->state, m_impl->channel, AMQP_QUEUE_BIND_METHOD, &req),
+               "queue.bind");
+}
+
+void
+AmqpChannel::exchangeBindNoWait(const std::string& destination,
+                                const std::string& source,
+                                const std::string& routing_key,
+                                const AmqpTable& arguments)
+{
+  amqp_exchange_bind_t req;
+  req.ticket = 0;
+  req.destination = amqp_cstring_bytes(destination.c_str());
+  req.source = amqp_cstring_bytes(source.c_str());
+  req.routing_key = amqp_cstring_bytes(routing_key.c_str());
+  req.nowait = 1;
+  AmqpTablePool pool;
+  req.arguments = pool.convert(arguments);
+  die_on_error(
+    amqp_send_method(
+      m_impl->state, m_impl->channel, AMQP_EXCHANGE_BIND_METHOD, &req),
+    "exchange.bind");
 }
 
 void
@@ -663,6 +1464,29 @@ AmqpChannel::queueUnbind(const std::string& queue_name,
                          const std::string& exchange_name,
                          const std::string& routing_key)
 {
+  amqp_queue_unbind(m_impl->state,
+                    m_impl->channel,
+                    amqp_cstring_bytes(queue_name.c_str()),
+                    amqp_cstring_bytes(exchange_name.c_str()),
+                    amqp_cstring_bytes(routing_key.c_str()),
+                    amqp_empty_table);
+  m_impl->checkRpcReply("queue.unbind");
+}
+
+void
+AmqpChannel::queueUnbind(const std::string& queue_name,
+                         const std::string& exchange_name,
+                         const std::string& routing_key,
+                         const AmqpTable& arguments)
+{
+  AmqpTablePool pool;
+  amqp_queue_unbind(m_impl->state,
+                    m_impl->channel,
+                    amqp_cstring_bytes(queue_name.c_str()),
+                    amqp_cstring_bytes(exchange_name.c_str()),
+                    amqp_cstring_bytes(routing_key.c_str()),
+                    pool.convert(arguments));
+  m_impl->checkRpcReply("queue.unbind");
 }
 
 void
@@ -672,8 +1496,9 @@ AmqpChannel::basicPublish(const std::string& exchange,
                           bool mandatory,
                           bool immediate)
 {
+  recycle_amqp_pool(&m_impl->pool);
   amqp_basic_properties_t props =
-    convert_to_amqp_basic_properties(message.properties());
+    convert_to_amqp_basic_properties(message.properties(), &m_impl->pool);
   die_on_error(amqp_basic_publish(m_impl->state,
                                   m_impl->channel,
                                   amqp_cstring_bytes(exchange.c_str()),
@@ -681,8 +1506,10 @@ AmqpChannel::basicPublish(const std::string& exchange,
                                   mandatory,
                                   immediate,
                                   &props,
-                                  amqp_cstring_bytes(message.body().c_str())),
+                                  amqp_bytes_t{ message.body().size(),
+                                                (void*)message.body().data() }),
                "basic.publish");
+  m_impl->track(1);
 }
 
 std::string
@@ -701,7 +1528,7 @@ AmqpChannel::basicConsume(const std::string& queue_name,
                        no_ack,
                        exclusive,
                        amqp_empty_table);
-  die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "basic.consume");
+  m_impl->checkRpcReply("basic.consume");
   return std::string((char*)r->consumer_tag.bytes, r->consumer_tag.len);
 }
 
@@ -711,10 +1538,16 @@ AmqpChannel::basicCancel(const std::string& consumer_tag)
   if (!consumer_tag.empty()) {
     amqp_basic_cancel(
       m_impl->state, m_impl->channel, amqp_cstring_bytes(consumer_tag.c_str()));
-    die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "basic.cancel");
+    m_impl->checkRpcReply("basic.cancel");
   }
 }
 
+bool
+AmqpChannel::consumerCancelled(const std::string& consumer_tag) const
+{
+  return m_impl->cancelled.count(consumer_tag) > 0;
+}
+
 void
 AmqpChannel::basicQos(uint32_t prefetch_size,
                       uint16_t prefetch_count,
@@ -722,10 +1555,10 @@ AmqpChannel::basicQos(uint32_t prefetch_size,
 {
   if (!amqp_basic_qos(m_impl->state,
                       m_impl->channel,
-                      prefetch_count,
                       prefetch_size,
+                      prefetch_count,
                       global)) {
-    die_on_amqp_error(amqp_get_rpc_reply(m_impl->state), "basic.qos");
+    m_impl->checkRpcReply("basic.qos");
   }
 }
 
@@ -746,6 +1579,191 @@ AmqpChannel::basicNack(uint64_t delivery_tag, bool multiple, bool requeue)
     "basic.nack");
 }
 
+void
+AmqpChannel::txSelect()
+{
+  amqp_tx_select(m_impl->state, m_impl->channel);
+  m_impl->checkRpcReply("tx.select");
+}
+
+void
+AmqpChannel::txCommit()
+{
+  amqp_tx_commit(m_impl->state, m_impl->channel);
+  m_impl->checkRpcReply("tx.commit");
+}
+
+void
+AmqpChannel::txRollback()
+{
+  amqp_tx_rollback(m_impl->state, m_impl->channel);
+  m_impl->checkRpcReply("tx.rollback");
+}
+
+void
+AmqpChannel::confirmSelect()
+{
+  amqp_confirm_select(m_impl->state, m_impl->channel);
+  m_impl->checkRpcReply("confirm.select");
+  m_impl->confirms = true;
+  m_impl->published = 0;
+  m_impl->unconfirmed.clear();
+  m_impl->nacked = false;
+}
+
+bool
+AmqpChannel::waitForConfirms(const struct timeval* timeout)
+{
+  if (!m_impl->confirms) {
+    die("waitForConfirms: confirm.select was not sent on this channel");
+  }
+  while (!m_impl->unconfirmed.empty()) {
+    amqp_frame_t frame;
+    amqp_maybe_release_buffers(m_impl->state);
+    int status =
+      amqp_simple_wait_frame_noblock(m_impl->state, &frame, timeout);
+    if (status == AMQP_STATUS_TIMEOUT)
+      return false;
+    die_on_error(status, "Waiting for confirms");
+    if (frame.frame_type != AMQP_FRAME_METHOD)
+      continue;
+
+    switch (frame.payload.method.id) {
+      case AMQP_BASIC_ACK_METHOD: {
+        auto ack = (amqp_basic_ack_t*)frame.payload.method.decoded;
+        m_impl->confirm(ack->delivery_tag, ack->multiple, false);
+        break;
+      }
+      case AMQP_BASIC_NACK_METHOD: {
+        auto nack = (amqp_basic_nack_t*)frame.payload.method.decoded;
+        m_impl->confirm(nack->delivery_tag, nack->multiple, true);
+        break;
+      }
+      default:
+        if (!m_impl->handleFrame(frame))
+          m_impl->unexpectedMethod(frame, "Waiting for confirms");
+        m_impl->checkOpen("Waiting for confirms");
+    }
+  }
+  return !std::exchange(m_impl->nacked, false);
+}
+
+void
+AmqpChannel::setReturnHandler(std::function<void(const AmqpReturn&)> handler)
+{
+  m_impl->on_return = std::move(handler);
+}
+
+std::size_t
+AmqpChannel::pollReturns(const struct timeval* timeout)
+{
+  std::size_t returned = 0;
+  for (;;) {
+    amqp_frame_t frame;
+    amqp_maybe_release_buffers(m_impl->state);
+    int status =
+      amqp_simple_wait_frame_noblock(m_impl->state, &frame, timeout);
+    if (status == AMQP_STATUS_TIMEOUT)
+      return returned;
+    die_on_error(status, "Polling returns");
+    if (frame.frame_type != AMQP_FRAME_METHOD)
+      continue;
+
+    switch (frame.payload.method.id) {
+      case AMQP_BASIC_RETURN_METHOD:
+        m_impl->handleReturn(frame);
+        returned++;
+        break;
+      case AMQP_BASIC_ACK_METHOD: {
+        auto ack = (amqp_basic_ack_t*)frame.payload.method.decoded;
+        m_impl->confirm(ack->delivery_tag, ack->multiple, false);
+        break;
+      }
+      case AMQP_BASIC_NACK_METHOD: {
+        auto nack = (amqp_basic_nack_t*)frame.payload.method.decoded;
+        m_impl->confirm(nack->delivery_tag, nack->multiple, true);
+        break;
+      }
+      default:
+        if (!m_impl->handleFrame(frame))
+          m_impl->unexpectedMethod(frame, "Polling returns");
+        m_impl->checkOpen("Polling returns");
+    }
+  }
+}
+
+AmqpEnvelope::Ptr
+AmqpChannel::basicGet(const std::string& queue_name,
+                      bool no_ack,
+                      std::uint32_t* message_count)
+{
+  auto messages = basicGet(queue_name, 1, no_ack, message_count);
+  return messages.empty() ? nullptr : messages.front();
+}
+
+std::vector<AmqpEnvelope::Ptr>
+AmqpChannel::basicGet(const std::string& queue_name,
+                      std::size_t count,
+                      bool no_ack,
+                      std::uint32_t* message_count)
+{
+  amqp_basic_get_t get;
+  get.ticket = 0;
+  get.queue = amqp_cstring_bytes(queue_name.c_str());
+  get.no_ack = no_ack;
+  for (std::size_t i = 0; i < count; i++) {
+    die_on_error(amqp_send_method(
+                   m_impl->state, m_impl->channel, AMQP_BASIC_GET_METHOD, &get),
+                 "basic.get");
+  }
+
+  std::vector<AmqpEnvelope::Ptr> messages;
+  for (std::size_t replies = 0; replies < count;) {
+    amqp_frame_t frame;
+    amqp_maybe_release_buffers(m_impl->state);
+    die_on_error(amqp_simple_wait_frame(m_impl->state, &frame), "basic.get");
+    if (frame.frame_type != AMQP_FRAME_METHOD) {
+      die("basic.get: unexpected frame type %d", frame.frame_type);
+    }
+
+    switch (frame.payload.method.id) {
+      case AMQP_BASIC_GET_EMPTY_METHOD:
+        if (message_count)
+          *message_count = 0;
+        replies++;
+        break;
+      case AMQP_BASIC_GET_OK_METHOD: {
+        auto ok = (amqp_basic_get_ok_t*)frame.payload.method.decoded;
+        std::uint64_t delivery_tag = ok->delivery_tag;
+        bool redelivered = ok->redelivered;
+        std::string exchange = amqp_bytes_string(ok->exchange);
+        std::string routing_key = amqp_bytes_string(ok->routing_key);
+        if (message_count)
+          *message_count = ok->message_count;
+
+        amqp_message_t content;
+        die_on_amqp_error(
+          amqp_read_message(m_impl->state, m_impl->channel, &content, 0),
+          "basic.get");
+        AmqpMessage message;
+        message.body() = amqp_bytes_string(content.body);
+        message.properties() = convert_to_amqp_properties(content.properties);
+        amqp_destroy_message(&content);
+
+        messages.push_back(AmqpEnvelope::createInstance(
+          message, "", delivery_tag, exchange, redelivered, routing_key));
+        replies++;
+        break;
+      }
+      default:
+        if (!m_impl->handleFrame(frame))
+          m_impl->unexpectedMethod(frame, "basic.get");
+        m_impl->checkOpen("basic.get");
+    }
+  }
+  return messages;
+}
+
 AmqpEnvelope::Ptr
 AmqpChannel::basicConsumeMessage(const struct timeval* timeout)
 {
@@ -757,7 +1775,12 @@ AmqpChannel::basicConsumeMessage(const struct timeval* timeout)
   std::string errorText{ "unknown" };
 
   if (AMQP_RESPONSE_NORMAL != res.reply_type) {
-    if (!checkConsumeMessageLibErr(res.library_error, m_impl->state, errorText))
+    auto unexpected = [this](const amqp_frame_t& frame) {
+      if (!m_impl->handleFrame(frame) && frame.frame_type == AMQP_FRAME_METHOD)
+        m_impl->unexpectedMethod(frame, "Consuming message");
+    };
+    if (!checkConsumeMessageLibErr(
+          res.library_error, m_impl->state, errorText, unexpected))
       throw std::runtime_error(errorText);
     return nullptr;
   }
@@ -779,297 +1802,3492 @@ AmqpChannel::basicConsumeMessage(const struct timeval* timeout)
   return envelope2;
 }
 
-} // end namespace amqp
-
-using namespace gs::amqp;
-
-struct MessageBroker::Impl
+AmqpEnvelope::Ptr
+AmqpChannel::basicConsumeMessage(
+  const struct timeval* timeout,
+  const std::function<bool(const AmqpDeliveryHead&)>& filter,
+  bool ack)
 {
-  std::string host;
-  int port;
-  std::string username;
-  std::string password;
-  std::string vhost;
-  int frame_max;
-  std::vector<std::thread> threads;
-  std::atomic<bool> close{ false };
-};
+  // The frames are read one by one instead of through amqp_consume_message,
+  // so that the body can be skipped once the header frame is decoded.
+  for (;;) {
+    amqp_frame_t frame;
+    amqp_maybe_release_buffers(m_impl->state);
+    int status = amqp_simple_wait_frame_noblock(m_impl->state, &frame, timeout);
+    if (status == AMQP_STATUS_TIMEOUT)
+      return nullptr;
+    die_on_error(status, "Consuming message");
+    if (frame.frame_type != AMQP_FRAME_METHOD ||
+        frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD) {
+      // a channel closed by the broker ends the consumer, see isOpen()
+      if (!m_impl->handleFrame(frame) && frame.frame_type == AMQP_FRAME_METHOD)
+        m_impl->unexpectedMethod(frame, "Consuming message");
+      return nullptr;
+    }
+    auto deliver = (amqp_basic_deliver_t*)frame.payload.method.decoded;
+
+    // Reads the next content frame of the delivery. Frames of the connection,
+    // such as connection.blocked, may come in between; returns false when
+    // the broker closed the channel instead.
+    auto content = [&](std::uint8_t type, const char* name) {
+      for (;;) {
+        status = amqp_simple_wait_frame(m_impl->state, &frame);
+        die_on_error(status, "Consuming message");
+        if (frame.channel == m_impl->channel && frame.frame_type == type)
+          return true;
+        bool handled = m_impl->handleFrame(frame);
+        if (frame.channel != m_impl->channel) {
+          if (!handled && frame.frame_type == AMQP_FRAME_METHOD)
+            m_impl->unexpectedMethod(frame, "Consuming message");
+          continue;
+        }
+        if (handled && m_impl->closed)
+          return false;
+        die("Consuming message: expected a %s frame", name);
+      }
+    };
 
-MessageBroker::MessageBroker(const std::string& host,
-                             int port,
-                             const std::string& username,
-                             const std::string& password,
-                             const std::string& vhost,
-                             int frame_max)
-  : m_impl(new Impl)
-{
-  std::srand(std::time(NULL));
+    if (!content(AMQP_FRAME_HEADER, "header"))
+      return nullptr;
+    auto properties =
+      (amqp_basic_properties_t*)frame.payload.properties.decoded;
+    std::size_t body_size = frame.payload.properties.body_size;
+
+    AmqpDeliveryHead head{
+      std::string_view((char*)deliver->exchange.bytes, deliver->exchange.len),
+      std::string_view((char*)deliver->routing_key.bytes,
+                       deliver->routing_key.len),
+      deliver->redelivered != 0,
+      convert_to_amqp_properties(*properties)
+    };
+    bool wanted = filter(head);
+
+    AmqpMessage message;
+    if (wanted)
+      message.body().reserve(body_size);
+    for (std::size_t received = 0; received < body_size;) {
+      if (!content(AMQP_FRAME_BODY, "body"))
+        return nullptr;
+      const auto& fragment = frame.payload.body_fragment;
+      received += fragment.len;
+      if (wanted)
+        message.body().append((char*)fragment.bytes, fragment.len);
+    }
 
-  if (host.empty()) {
-    throw std::runtime_error("host is not specified, it is required");
-  }
-  if (vhost.empty()) {
-    throw std::runtime_error("vhost is not specified, it is required");
-  }
-  if (port <= 0) {
-    throw std::runtime_error(
-      "port is not valm_id, it must be a positive number");
+    if (!wanted) {
+      if (ack)
+        basicAck(deliver->delivery_tag);
+      continue;
+    }
+    message.properties() = std::move(head.properties);
+    std::string consumer_tag = amqp_bytes_string(deliver->consumer_tag);
+    return AmqpEnvelope::createInstance(message,
+                                        consumer_tag,
+                                        deliver->delivery_tag,
+                                        std::string(head.exchange),
+                                        deliver->redelivered,
+                                        std::string(head.routing_key));
   }
-
-  m_impl->host = host;
-  m_impl->port = port;
-  m_impl->username = username;
-  m_impl->password = password;
-  m_impl->vhost = vhost;
-  m_impl->frame_max = frame_max;
 }
 
-MessageBroker::MessageBroker(const std::string& url, int frame_max)
-  : m_impl(new Impl)
+static void
+put_u8(std::string& out, std::uint8_t v)
 {
-  std::srand(std::time(NULL));
+  out.push_back(char(v));
+}
 
-  struct amqp_connection_info ci;
-  char* p = strdup(url.c_str());
+static void
+put_u16(std::string& out, std::uint16_t v)
+{
+  put_u8(out, v >> 8);
+  put_u8(out, v);
+}
 
-  die_on_error(amqp_parse_url(p, &ci), "Parsing URL");
+static void
+put_u32(std::string& out, std::uint32_t v)
+{
+  put_u16(out, v >> 16);
+  put_u16(out, v);
+}
 
-  m_impl->host = ci.host;
-  m_impl->port = ci.port;
-  m_impl->username = ci.user;
-  m_impl->password = ci.password;
-  m_impl->vhost = ci.vhost;
-  m_impl->frame_max = frame_max;
+static void
+put_u64(std::string& out, std::uint64_t v)
+{
+  put_u32(out, v >> 32);
+  put_u32(out, v);
+}
 
-  free(p);
+static void
+put_shortstr(std::string& out, const std::string& v)
+{
+  if (v.size() > 255) {
+    die("AMQP short string too long: %zu bytes", v.size());
+  }
+  put_u8(out, v.size());
+  out += v;
 }
 
-MessageBroker::~MessageBroker()
+static void
+put_table(std::string& out, const AmqpTable& table)
 {
-  m_impl->close = true;
-  for (auto it = m_impl->threads.begin(); it != m_impl->threads.end(); it++) {
-    it->join();
+  AmqpTablePool pool;
+  amqp_table_t t = pool.convert(table);
+  std::string buffer(1024, '\0');
+  for (;;) {
+    size_t offset = 0;
+    int status = amqp_encode_table(
+      amqp_bytes_t{ buffer.size(), (void*)buffer.data() }, &t, &offset);
+    if (status == AMQP_STATUS_OK) {
+      out.append(buffer.data(), offset);
+      return;
+    }
+    if (status != AMQP_STATUS_TABLE_TOO_BIG) {
+      die_on_error(status, "Encoding AMQP table");
+    }
+    buffer.resize(buffer.size() * 2);
   }
 }
 
-const std::string
-MessageBroker::generateRandomString()
+/// Writes @p iov to @p fd entirely, waiting while the socket is full.
+static void
+send_iovecs(int fd, std::vector<struct iovec>& iov, int timeout)
 {
-  static const char ALPHABET[] = { "0123456789"
-                                   "abcdefgjhiklmnopqrstvwxyz"
-                                   "ABCDEFGJHIKLMNOPQRSTVWXYZ" };
-  std::string result;
-  for (std::size_t i = 0; i < 16; i++) {
-    result += ALPHABET[rand() % (sizeof(ALPHABET) - 1)];
+  std::size_t i = 0;
+  while (i < iov.size()) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov[i];
+    msg.msg_iovlen = std::min<std::size_t>(iov.size() - i, IOV_MAX);
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // a blocked broker stops reading, the socket never drains then
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == 0)
+          die("basic.publish: timed out writing, the broker may have "
+              "blocked the connection");
+        if (ready < 0 && errno != EINTR)
+          die("basic.publish: %s", strerror(errno));
+        continue;
+      }
+      die("basic.publish: %s", strerror(errno));
+    }
+    for (; i < iov.size() && std::size_t(n) >= iov[i].iov_len; ++i) {
+      n -= iov[i].iov_len;
+    }
+    if (n > 0) {
+      iov[i].iov_base = (char*)iov[i].iov_base + n;
+      iov[i].iov_len -= n;
+    }
   }
-  return result;
 }
 
-const char* MessageBroker::MESSAGE_TYPE_REQUEST = "request";
+/// Encodes the basic class properties @p p in the order of their flags, but
+/// the correlation id: the properties before it are appended to @p head and
+/// those after it to @p tail. Returns the flags, without the correlation id.
+static std::uint16_t
+encode_basic_properties(const AmqpProperties& p,
+                        std::string& head,
+                        std::string& tail)
+{
+  std::uint16_t flags = 0;
+  if (p.content_type.has_value()) {
+    flags |= AMQP_BASIC_CONTENT_TYPE_FLAG;
+    put_shortstr(head, p.content_type.value());
+  }
+  if (p.content_encoding.has_value()) {
+    flags |= AMQP_BASIC_CONTENT_ENCODING_FLAG;
+    put_shortstr(head, p.content_encoding.value());
+  }
+  if (p.headers.has_value()) {
+    flags |= AMQP_BASIC_HEADERS_FLAG;
+    put_table(head, p.headers.value());
+  }
+  if (p.delivery_mode.has_value()) {
+    flags |= AMQP_BASIC_DELIVERY_MODE_FLAG;
+    put_u8(head, p.delivery_mode.value());
+  }
+  if (p.priority.has_value()) {
+    flags |= AMQP_BASIC_PRIORITY_FLAG;
+    put_u8(head, p.priority.value());
+  }
+  if (p.reply_to.has_value()) {
+    flags |= AMQP_BASIC_REPLY_TO_FLAG;
+    put_shortstr(tail, p.reply_to.value());
+  }
+  if (p.expiration.has_value()) {
+    flags |= AMQP_BASIC_EXPIRATION_FLAG;
+    put_shortstr(tail, p.expiration.value());
+  }
+  if (p.message_id.has_value()) {
+    flags |= AMQP_BASIC_MESSAGE_ID_FLAG;
+    put_shortstr(tail, p.message_id.value());
+  }
+  if (p.timestamp.has_value()) {
+    flags |= AMQP_BASIC_TIMESTAMP_FLAG;
+    put_u64(tail, p.timestamp.value());
+  }
+  if (p.type.has_value()) {
+    flags |= AMQP_BASIC_TYPE_FLAG;
+    put_shortstr(tail, p.type.value());
+  }
+  if (p.user_id.has_value()) {
+    flags |= AMQP_BASIC_USER_ID_FLAG;
+    put_shortstr(tail, p.user_id.value());
+  }
+  if (p.app_id.has_value()) {
+    flags |= AMQP_BASIC_APP_ID_FLAG;
+    put_shortstr(tail, p.app_id.value());
+  }
+  if (p.cluster_id.has_value()) {
+    flags |= AMQP_BASIC_CLUSTER_ID_FLAG;
+    put_shortstr(tail, p.cluster_id.value());
+  }
+  return flags;
+}
 
-const char* MessageBroker::MESSAGE_TYPE_RESPONSE = "response";
+static std::size_t
+table_size(const AmqpTable& table);
 
-const char* MessageBroker::MESSAGE_TYPE_ERROR = "error";
+/// Size of @p value in a field table or array, with its type octet.
+static std::size_t
+field_value_size(const AmqpTableValue& value)
+{
+  switch (value.getType()) {
+    case AmqpTableValue::VT_bool:
+    case AmqpTableValue::VT_int8:
+    case AmqpTableValue::VT_uint8:
+      return 1 + 1;
+    case AmqpTableValue::VT_int16:
+    case AmqpTableValue::VT_uint16:
+      return 1 + 2;
+    case AmqpTableValue::VT_int32:
+    case AmqpTableValue::VT_uint32:
+    case AmqpTableValue::VT_float:
+      return 1 + 4;
+    case AmqpTableValue::VT_int64:
+    case AmqpTableValue::VT_uint64:
+    case AmqpTableValue::VT_double:
+      return 1 + 8;
+    case AmqpTableValue::VT_string:
+      return 1 + 4 + value.getString().size();
+    case AmqpTableValue::VT_array: {
+      std::size_t size = 1 + 4;
+      for (const auto& entry : value.getArray()) {
+        size += field_value_size(entry);
+      }
+      return size;
+    }
+    case AmqpTableValue::VT_table:
+      return 1 + table_size(value.getTable());
+  }
+  return 1;
+}
 
-void
-MessageBroker::publish(const Configuration& cfg, Message msg)
+/// Size of @p table as put_table() encodes it.
+static std::size_t
+table_size(const AmqpTable& table)
 {
-  AmqpConnection::Ptr conn = AmqpConnection::createInstance();
-  conn->open(m_impl->host, m_impl->port);
-  conn->login(
-    m_impl->vhost, m_impl->username, m_impl->password, m_impl->frame_max);
+  std::size_t size = 4;
+  for (const auto& [key, value] : table) {
+    size += 1 + key.size() + field_value_size(value);
+  }
+  return size;
+}
 
-  AmqpChannel::Ptr channel = AmqpChannel::createInstance(conn);
-  auto [exchange, queue] = setup(cfg, channel);
+/// Size of the basic class properties @p p on the wire, with their flags
+/// and the correlation id, computed without encoding them.
+static std::size_t
+basic_properties_size(const AmqpProperties& p)
+{
+  auto shortstr = [](const std::optional<std::string>& v) {
+    return v.has_value() ? 1 + v->size() : 0;
+  };
+  std::size_t size = 2;
+  size += shortstr(p.content_type) + shortstr(p.content_encoding);
+  if (p.headers.has_value())
+    size += table_size(p.headers.value());
+  size += p.delivery_mode.has_value() ? 1 : 0;
+  size += p.priority.has_value() ? 1 : 0;
+  size += shortstr(p.correlation_id) + shortstr(p.reply_to) +
+          shortstr(p.expiration) + shortstr(p.message_id);
+  size += p.timestamp.has_value() ? 8 : 0;
+  size += shortstr(p.type) + shortstr(p.user_id) + shortstr(p.app_id) +
+          shortstr(p.cluster_id);
+  return size;
+}
 
-  if (!msg.properties().content_type.has_value())
-    msg.properties().content_type = "application/json";
-  if (!msg.properties().delivery_mode.has_value())
-    msg.properties().delivery_mode = 2u;
+struct AmqpPreparedPublish::Impl
+{
+  AmqpChannel::Ptr channel;
+  /// complete basic.publish method frame
+  std::string method_frame;
+  /// property flags, without the correlation id
+  std::uint16_t flags;
+  /// encoded properties before and after the correlation id
+  std::string head_properties;
+  std::string tail_properties;
+  std::optional<std::string> correlation_id;
+  /// scratch buffers reused by every publish
+  std::string header_frame;
+  std::string body_frame_headers;
+  std::vector<struct iovec> iov;
+};
 
-  channel->basicPublish(exchange, cfg.routing_key, msg);
+AmqpPreparedPublish::AmqpPreparedPublish(const AmqpChannel::Ptr channel,
+                                         const std::string& exchange,
+                                         const std::string& routing_key,
+                                         const AmqpProperties& properties,
+                                         bool mandatory,
+                                         bool immediate)
+  : m_impl(new Impl)
+{
+  m_impl->channel = channel;
+  amqp_channel_t id = channel->m_impl->channel;
+
+  std::string payload;
+  put_u32(payload, AMQP_BASIC_PUBLISH_METHOD);
+  put_u16(payload, 0); // ticket
+  put_shortstr(payload, exchange);
+  put_shortstr(payload, routing_key);
+  put_u8(payload, (mandatory ? 1 : 0) | (immediate ? 2 : 0));
+
+  std::string& frame = m_impl->method_frame;
+  put_u8(frame, AMQP_FRAME_METHOD);
+  put_u16(frame, id);
+  put_u32(frame, payload.size());
+  frame += payload;
+  put_u8(frame, AMQP_FRAME_END);
+
+  m_impl->correlation_id = properties.correlation_id;
+  m_impl->flags = encode_basic_properties(
+    properties, m_impl->head_properties, m_impl->tail_properties);
 }
 
-MessageBroker::Response::Ptr
+AmqpPreparedPublish::~AmqpPreparedPublish() {}
+
+void
+AmqpPreparedPublish::publish(const std::string& body,
+                             const std::optional<std::string>& correlation_id)
+{
+  amqp_channel_t id = m_impl->channel->m_impl->channel;
+  const auto& cid =
+    correlation_id.has_value() ? correlation_id : m_impl->correlation_id;
+
+  std::uint16_t flags = m_impl->flags;
+  std::uint32_t size = 14 + m_impl->head_properties.size() +
+                       m_impl->tail_properties.size();
+  if (cid.has_value()) {
+    flags |= AMQP_BASIC_CORRELATION_ID_FLAG;
+    size += 1 + cid->size();
+  }
+
+  std::string& header = m_impl->header_frame;
+  header.clear();
+  put_u8(header, AMQP_FRAME_HEADER);
+  put_u16(header, id);
+  put_u32(header, size);
+  put_u16(header, AMQP_BASIC_CLASS);
+  put_u16(header, 0); // weight
+  put_u64(header, body.size());
+  put_u16(header, flags);
+  header += m_impl->head_properties;
+  if (cid.has_value())
+    put_shortstr(header, cid.value());
+  header += m_impl->tail_properties;
+  put_u8(header, AMQP_FRAME_END);
+
+  // body frames: 7 bytes of frame header, a fragment and the frame end
+  static const char frame_end = char(AMQP_FRAME_END);
+  auto conn = m_impl->channel->m_impl->conn;
+  int fd = conn->rawSocket("basic.publish");
+  std::size_t fragment = conn->bodyFragment();
+  std::size_t frames = (body.size() + fragment - 1) / fragment;
+  std::string& headers = m_impl->body_frame_headers;
+  headers.clear();
+  for (std::size_t offset = 0; offset < body.size(); offset += fragment) {
+    put_u8(headers, AMQP_FRAME_BODY);
+    put_u16(headers, id);
+    put_u32(headers, std::min(fragment, body.size() - offset));
+  }
+
+  auto& iov = m_impl->iov;
+  iov.clear();
+  iov.push_back({ (void*)m_impl->method_frame.data(),
+                  m_impl->method_frame.size() });
+  iov.push_back({ (void*)header.data(), header.size() });
+  for (std::size_t i = 0; i < frames; ++i) {
+    std::size_t offset = i * fragment;
+    iov.push_back({ (void*)(headers.data() + i * 7), 7 });
+    iov.push_back({ (void*)(body.data() + offset),
+                    std::min(fragment, body.size() - offset) });
+    iov.push_back({ (void*)&frame_end, 1 });
+  }
+
+  send_iovecs(fd, iov, conn->timeout);
+  m_impl->channel->m_impl->track(1);
+}
+
+void
+AmqpChannel::basicPublish(const std::vector<AmqpPublication>& publications)
+{
+  amqp_channel_t id = m_impl->channel;
+  int fd = m_impl->conn->rawSocket("basic.publish");
+  std::size_t fragment = m_impl->conn->bodyFragment();
+  std::string buffer;
+  std::string payload;
+  std::string head;
+  std::string tail;
+
+  for (const auto& publication : publications) {
+    payload.clear();
+    put_u32(payload, AMQP_BASIC_PUBLISH_METHOD);
+    put_u16(payload, 0); // ticket
+    put_shortstr(payload, publication.exchange);
+    put_shortstr(payload, publication.routing_key);
+    put_u8(payload,
+           (publication.mandatory ? 1 : 0) | (publication.immediate ? 2 : 0));
+    put_u8(buffer, AMQP_FRAME_METHOD);
+    put_u16(buffer, id);
+    put_u32(buffer, payload.size());
+    buffer += payload;
+    put_u8(buffer, AMQP_FRAME_END);
+
+    const auto& p = publication.message.properties();
+    head.clear();
+    tail.clear();
+    std::uint16_t flags = encode_basic_properties(p, head, tail);
+    if (p.correlation_id.has_value()) {
+      flags |= AMQP_BASIC_CORRELATION_ID_FLAG;
+      put_shortstr(head, p.correlation_id.value());
+    }
+    const std::string& body = publication.message.body();
+    put_u8(buffer, AMQP_FRAME_HEADER);
+    put_u16(buffer, id);
+    put_u32(buffer, 14 + head.size() + tail.size());
+    put_u16(buffer, AMQP_BASIC_CLASS);
+    put_u16(buffer, 0); // weight
+    put_u64(buffer, body.size());
+    put_u16(buffer, flags);
+    buffer += head;
+    buffer += tail;
+    put_u8(buffer, AMQP_FRAME_END);
+
+    for (std::size_t offset = 0; offset < body.size(); offset += fragment) {
+      std::size_t size = std::min(fragment, body.size() - offset);
+      put_u8(buffer, AMQP_FRAME_BODY);
+      put_u16(buffer, id);
+      put_u32(buffer, size);
+      buffer.append(body, offset, size);
+      put_u8(buffer, AMQP_FRAME_END);
+    }
+  }
+
+  std::vector<struct iovec> iov{ { (void*)buffer.data(), buffer.size() } };
+  send_iovecs(fd, iov, m_impl->conn->timeout);
+  m_impl->track(publications.size());
+}
+
+} // end namespace amqp
+
+using namespace gs::amqp;
+
+/// A topology step; `nowait` asks it not to wait for the broker's reply.
+using Declaration = std::function<void(AmqpChannel&, bool nowait)>;
+
+/// Appends the steps declaring @p cfg to @p out. The names to publish to and
+/// consume from are stored in @p names, the queue name only once its step ran.
+static void
+plan_declarations(const MessageBroker::Configuration& cfg,
+                  std::shared_ptr<std::pair<std::string, std::string>> names,
+                  std::vector<Declaration>& out)
+{
+  if (cfg.exchange.name == "amq") {
+    names->first = "amq." + cfg.exchange.type;
+  }
+
+  if (cfg.exchange.declare) {
+    out.push_back([cfg](AmqpChannel& channel, bool nowait) {
+      const auto& e = cfg.exchange;
+      if (nowait) {
+        channel.exchangeDeclareNoWait(e.name,
+                                      e.type,
+                                      e.passive,
+                                      e.durable,
+                                      e.auto_delete,
+                                      e.internal,
+                                      e.arguments.value_or(AmqpTable()));
+      } else if (e.arguments.has_value()) {
+        channel.exchangeDeclare(e.name,
+                                e.type,
+                                e.passive,
+                                e.durable,
+                                e.auto_delete,
+                                e.internal,
+                                e.arguments.value());
+      } else {
+        channel.exchangeDeclare(
+          e.name, e.type, e.passive, e.durable, e.auto_delete, e.internal);
+      }
+    });
+    names->first = cfg.exchange.name;
+  }
+
+  if (cfg.queue.declare) {
+    out.push_back([cfg, names](AmqpChannel& channel, bool nowait) {
+      const auto& q = cfg.queue;
+      if (nowait && !q.name.empty()) {
+        channel.queueDeclareNoWait(q.name,
+                                   q.passive,
+                                   q.durable,
+                                   q.exclusive,
+                                   q.auto_delete,
+                                   q.arguments.value_or(AmqpTable()));
+        names->second = q.name;
+      } else if (q.arguments.has_value()) {
+        names->second = channel.queueDeclare(q.name,
+                                             q.passive,
+                                             q.durable,
+                                             q.exclusive,
+                                             q.auto_delete,
+                                             q.arguments.value());
+      } else {
+        names->second = channel.queueDeclare(
+          q.name, q.passive, q.durable, q.exclusive, q.auto_delete);
+      }
+    });
+  }
+
+  if (cfg.queue.bind) {
+    std::string binding_key =
+      cfg.exchange.type == AmqpChannel::EXCHANGE_TYPE_TOPIC
+        ? cfg.routing_pattern
+        : cfg.routing_key;
+    auto arguments = cfg.binding_arguments.value_or(AmqpTable());
+    out.push_back(
+      [names, binding_key, arguments](AmqpChannel& channel, bool nowait) {
+        if (nowait)
+          channel.queueBindNoWait(
+            names->second, names->first, binding_key, arguments);
+        else
+          channel.queueBind(
+            names->second, names->first, binding_key, arguments);
+      });
+  }
+}
+
+/// Runs @p steps pipelined: every step but the last is sent `nowait`, so the
+/// reply to the last one acknowledges (or reports the failure of) them all.
+static void
+run_declarations(AmqpChannel& channel, const std::vector<Declaration>& steps)
+{
+  for (std::size_t i = 0; i < steps.size(); ++i) {
+    steps[i](channel, i + 1 < steps.size());
+  }
+}
+
+static std::string
+table_fingerprint(const AmqpTable& table);
+
+static std::string
+value_fingerprint(const AmqpTableValue& value)
+{
+  std::string s = std::to_string(value.getType()) + ":";
+  switch (value.getType()) {
+    case AmqpTableValue::VT_bool:
+      return s + std::to_string(value.getBool());
+    case AmqpTableValue::VT_int8:
+      return s + std::to_string(value.getInt8());
+    case AmqpTableValue::VT_int16:
+      return s + std::to_string(value.getInt16());
+    case AmqpTableValue::VT_int32:
+      return s + std::to_string(value.getInt32());
+    case AmqpTableValue::VT_int64:
+      return s + std::to_string(value.getInt64());
+    case AmqpTableValue::VT_float:
+      return s + std::to_string(value.getFloat());
+    case AmqpTableValue::VT_double:
+      return s + std::to_string(value.getDouble());
+    case AmqpTableValue::VT_string:
+      return s + std::to_string(value.getString().size()) + ":" +
+             value.getString();
+    case AmqpTableValue::VT_array: {
+      auto array = value.getArray();
+      s += std::to_string(array.size()) + "[";
+      for (const auto& v : array)
+        s += value_fingerprint(v) + ",";
+      return s + "]";
+    }
+    case AmqpTableValue::VT_table:
+      return s + table_fingerprint(value.getTable());
+    case AmqpTableValue::VT_uint8:
+      return s + std::to_string(value.getUint8());
+    case AmqpTableValue::VT_uint16:
+      return s + std::to_string(value.getUint16());
+    case AmqpTableValue::VT_uint32:
+      return s + std::to_string(value.getUint32());
+    case AmqpTableValue::VT_uint64:
+      return s + std::to_string(value.getUint64());
+  }
+  return s;
+}
+
+static std::string
+table_fingerprint(const AmqpTable& table)
+{
+  std::string s = "{";
+  for (const auto& [key, value] : table) {
+    s += std::to_string(key.size()) + ":" + key + "=" +
+         value_fingerprint(value) + ",";
+  }
+  return s + "}";
+}
+
+static std::string
+binding_fingerprint(const MessageBroker::Binding& b)
+{
+  return std::string(b.exchange ? "exchange-binding/" : "binding/") +
+         std::to_string(b.source.size()) + ":" + b.source + "/" +
+         std::to_string(b.destination.size()) + ":" + b.destination + "/" +
+         std::to_string(b.routing_key.size()) + ":" + b.routing_key + "/" +
+         table_fingerprint(b.arguments.value_or(AmqpTable()));
+}
+
+/// Converts a key file value to the table value RabbitMQ expects for
+/// arguments such as `x-message-ttl` (integer) or `x-dead-letter-exchange`.
+static AmqpTableValue
+parse_table_value(const std::string& text)
+{
+  if (text == "true" || text == "false")
+    return AmqpTableValue(text == "true");
+  if (!text.empty()) {
+    char* end = nullptr;
+    gint64 number = g_ascii_strtoll(text.c_str(), &end, 10);
+    if (end && *end == '\0')
+      return AmqpTableValue(std::int64_t(number));
+  }
+  return AmqpTableValue(text);
+}
+
+/// The bodies a publish put in the blob store, removed again unless the
+/// publish went through.
+class ClaimCheck
+{
+public:
+  ClaimCheck(const MessageBroker::Configuration& cfg)
+    : m_cfg(cfg)
+  {
+  }
+
+  ~ClaimCheck()
+  {
+    for (const auto& reference : m_references) {
+      try {
+        m_cfg.claim_check.store->remove(reference);
+      } catch (const std::runtime_error&) {
+        // the publish failed already, this error is not the one to report
+      }
+    }
+  }
+
+  /// Puts a body above the claim check threshold in the blob store and
+  /// replaces it with its reference.
+  void checkIn(AmqpMessage& msg)
+  {
+    const auto& claim_check = m_cfg.claim_check;
+    if (!claim_check.store || msg.body().size() <= claim_check.threshold)
+      return;
+
+    std::string reference = claim_check.store->put(msg.body());
+    if (claim_check.remove)
+      m_references.push_back(reference);
+    auto& headers = msg.properties().headers;
+    if (!headers.has_value())
+      headers = AmqpTable();
+    headers->insert_or_assign(AmqpBlobStore::HEADER,
+                              AmqpTableValue(reference));
+    msg.body().clear();
+  }
+
+  /// The messages were published, their bodies are owned by the consumers.
+  void commit() { m_references.clear(); }
+
+  /// The references removed unless the publish goes through, taken over by
+  /// whoever publishes it later.
+  std::vector<std::string>& references() { return m_references; }
+
+private:
+  const MessageBroker::Configuration& m_cfg;
+  std::vector<std::string> m_references;
+};
+
+/// The blob store reference of @p msg, if its body was sent by reference.
+static std::optional<std::string>
+claim_reference(const AmqpMessage& msg)
+{
+  const auto& headers = msg.properties().headers;
+  if (!headers.has_value())
+    return std::nullopt;
+  auto it = headers->find(AmqpBlobStore::HEADER);
+  if (it == headers->end() || it->second.getType() != AmqpTableValue::VT_string)
+    return std::nullopt;
+  return it->second.getString();
+}
+
+/// Defers the body of a message sent by reference to the blob store, so it
+/// is only fetched if the handler reads it.
+static AmqpEnvelope::Ptr
+check_out(const MessageBroker::Configuration& cfg, AmqpEnvelope::Ptr envelope)
+{
+  if (!cfg.claim_check.store)
+    return envelope;
+  auto reference = claim_reference(envelope->message());
+  if (!reference.has_value())
+    return envelope;
+
+  auto store = cfg.claim_check.store;
+  AmqpMessage message = envelope->message();
+  message.setBodyLoader(
+    [store, reference = reference.value()]() { return store->get(reference); });
+  return AmqpEnvelope::createInstance(message,
+                                      envelope->consumerTag(),
+                                      envelope->deliveryTag(),
+                                      envelope->exchange(),
+                                      envelope->redelivered(),
+                                      envelope->routingKey());
+}
+
+/// Removes the stored body of a message which was processed, see
+/// Configuration::claim_check.
+static void
+check_done(const MessageBroker::Configuration& cfg, const AmqpMessage& msg)
+{
+  if (!cfg.claim_check.store || !cfg.claim_check.remove)
+    return;
+  auto reference = claim_reference(msg);
+  if (!reference.has_value())
+    return;
+  try {
+    cfg.claim_check.store->remove(reference.value());
+  } catch (const std::runtime_error&) {
+    // the message was handled, a body left behind only takes space
+  }
+}
+
+/// Returns @p value as an integer, if it is a number.
+static std::optional<std::int64_t>
+table_integer(const AmqpTableValue& value)
+{
+  switch (value.getType()) {
+    case AmqpTableValue::VT_int8:
+      return value.getInt8();
+    case AmqpTableValue::VT_int16:
+      return value.getInt16();
+    case AmqpTableValue::VT_int32:
+      return value.getInt32();
+    case AmqpTableValue::VT_int64:
+      return value.getInt64();
+    case AmqpTableValue::VT_uint8:
+      return value.getUint8();
+    case AmqpTableValue::VT_uint16:
+      return value.getUint16();
+    case AmqpTableValue::VT_uint32:
+      return value.getUint32();
+    case AmqpTableValue::VT_uint64:
+      return std::int64_t(value.getUint64());
+    case AmqpTableValue::VT_float:
+      return std::int64_t(value.getFloat());
+    case AmqpTableValue::VT_double:
+      return std::int64_t(value.getDouble());
+    default:
+      return std::nullopt;
+  }
+}
+
+/// Whether @p properties carry a deadline, see Configuration::expiry, which
+/// has passed.
+static bool
+is_expired(const MessageBroker::Configuration& cfg,
+           const AmqpProperties& properties)
+{
+  std::optional<std::int64_t> deadline;
+  if (properties.timestamp.has_value() && properties.expiration.has_value()) {
+    char* end = nullptr;
+    const char* ttl = properties.expiration->c_str();
+    long long ms = strtoll(ttl, &end, 10);
+    if (end != ttl && *end == '\0')
+      deadline = std::int64_t(properties.timestamp.value()) * 1000 + ms;
+  }
+  if (properties.headers.has_value()) {
+    auto it = properties.headers->find(cfg.expiry.header);
+    if (it != properties.headers->end()) {
+      auto header = table_integer(it->second);
+      if (header.has_value())
+        deadline = std::min(deadline.value_or(header.value()), header.value());
+    }
+  }
+  if (!deadline.has_value())
+    return false;
+
+  auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch());
+  return now.count() >= deadline.value();
+}
+
+/// Remembers the keys of handled deliveries in constant memory: the last
+/// few exactly, and those of the last one to two windows in two Bloom filters
+/// which take turns. Keys being handled are marked in flight, so that the
+/// consumers of a group sharing it handle a key once.
+class Deduplicator
+{
+public:
+  Deduplicator(std::chrono::seconds window,
+               std::size_t capacity,
+               double false_positive_rate,
+               std::size_t exact)
+    : m_window(window)
+    , m_ring(std::max<std::size_t>(exact, 1))
+  {
+    // optimal Bloom filter for `capacity` keys at `false_positive_rate`
+    double n = std::max<std::size_t>(capacity, 1);
+    double p = std::clamp(false_positive_rate, 1e-12, 0.5);
+    double bits = std::ceil(-n * std::log(p) / (std::log(2) * std::log(2)));
+    m_hashes = std::max(1, int(std::round(bits / n * std::log(2))));
+    m_current.assign((std::size_t(bits) + 63) / 64, 0);
+    m_previous = m_current;
+    m_rotated = std::chrono::steady_clock::now();
+  }
+
+  /// Marks @p key in flight, unless it was handled or is in flight already,
+  /// in which case the delivery is a duplicate and `false` is returned.
+  bool acquire(const std::string& key)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    rotate();
+    if (m_exact.count(key) || m_in_flight.count(key))
+      return false;
+    auto h = hash(key);
+    if (test(m_current, h) || test(m_previous, h))
+      return false;
+    m_in_flight.insert(key);
+    return true;
+  }
+
+  /// Ends the handling of an acquired key, remembered if @p handled; a key
+  /// whose delivery failed comes again.
+  void release(const std::string& key, bool handled)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_in_flight.erase(key);
+    if (!handled)
+      return;
+    rotate();
+    if (!m_exact.insert(key).second)
+      return;
+    auto& slot = m_ring[m_next++ % m_ring.size()];
+    if (!slot.empty())
+      m_exact.erase(slot);
+    slot = key;
+
+    auto h = hash(key);
+    std::uint64_t bits = m_current.size() * 64;
+    for (int i = 0; i < m_hashes; i++) {
+      std::uint64_t bit = (h.first + i * h.second) % bits;
+      m_current[bit / 64] |= 1ull << (bit % 64);
+    }
+  }
+
+private:
+  /// two 64 bit FNV-1a hashes for double hashing
+  static std::pair<std::uint64_t, std::uint64_t> hash(const std::string& key)
+  {
+    std::uint64_t h1 = 14695981039346656037ull;
+    std::uint64_t h2 = 0x9e3779b97f4a7c15ull;
+    for (char c : key) {
+      h1 = (h1 ^ std::uint8_t(c)) * 1099511628211ull;
+      h2 = (h2 ^ std::uint8_t(c)) * 0x100000001b3ull + 0x5bd1e995;
+    }
+    return { h1, h2 | 1 };
+  }
+
+  bool test(const std::vector<std::uint64_t>& filter,
+            const std::pair<std::uint64_t, std::uint64_t>& h) const
+  {
+    std::uint64_t bits = filter.size() * 64;
+    for (int i = 0; i < m_hashes; i++) {
+      std::uint64_t bit = (h.first + i * h.second) % bits;
+      if (!(filter[bit / 64] & (1ull << (bit % 64))))
+        return false;
+    }
+    return true;
+  }
+
+  void rotate()
+  {
+    auto now = std::chrono::steady_clock::now();
+    if (now - m_rotated < m_window)
+      return;
+    m_previous.swap(m_current);
+    std::fill(m_current.begin(), m_current.end(), 0);
+    if (now - m_rotated >= 2 * m_window)
+      std::fill(m_previous.begin(), m_previous.end(), 0);
+    m_rotated = now;
+  }
+
+  std::mutex m_mutex;
+  std::chrono::seconds m_window;
+  std::chrono::steady_clock::time_point m_rotated;
+  int m_hashes;
+  std::vector<std::uint64_t> m_current;
+  std::vector<std::uint64_t> m_previous;
+  std::vector<std::string> m_ring;
+  std::size_t m_next = 0;
+  std::unordered_set<std::string> m_exact;
+  std::unordered_set<std::string> m_in_flight;
+};
+
+/// Heavy hitters of a stream of keys per time window: a count-min sketch
+/// estimates the count of any key in constant memory, and the keys with the
+/// highest estimates are kept aside.
+class HotKeys
+{
+public:
+  using Top = std::vector<MessageBroker::Metrics::HotKey>;
+
+  HotKeys(std::size_t k, std::chrono::milliseconds window)
+    : m_k(std::max<std::size_t>(k, 1))
+    , m_window(std::max<std::int64_t>(
+        std::chrono::nanoseconds(window).count(), 1))
+  {
+    m_end = now() + m_window;
+  }
+
+  void add(std::string_view key)
+  {
+    std::int64_t t = now();
+    if (t >= m_end.load(std::memory_order_relaxed))
+      rotate(t);
+
+    // FNV-1a, split in two halves for double hashing
+    std::uint64_t h = 14695981039346656037ull;
+    for (char c : key) {
+      h = (h ^ std::uint8_t(c)) * 1099511628211ull;
+    }
+    std::uint32_t h1 = std::uint32_t(h);
+    std::uint32_t h2 = std::uint32_t(h >> 32) | 1;
+    std::uint32_t estimate = UINT32_MAX;
+    for (std::size_t row = 0; row < DEPTH; row++) {
+      auto& counter = m_counts[row * WIDTH + (h1 + row * h2) % WIDTH];
+      estimate = std::min(
+        estimate, counter.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+    // most keys stop here once the top is full
+    if (estimate <= m_threshold.load(std::memory_order_relaxed))
+      return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = std::find_if(m_top.begin(), m_top.end(), [key](const auto& e) {
+      return e.key == key;
+    });
+    if (it != m_top.end()) {
+      it->count = std::max<std::uint64_t>(it->count, estimate);
+    } else if (m_top.size() < m_k) {
+      m_top.push_back({ std::string(key), estimate });
+    } else {
+      auto min = std::min_element(
+        m_top.begin(), m_top.end(), [](const auto& a, const auto& b) {
+          return a.count < b.count;
+        });
+      if (min->count >= estimate)
+        return;
+      *min = { std::string(key), estimate };
+    }
+    if (m_top.size() == m_k) {
+      auto min = std::min_element(
+        m_top.begin(), m_top.end(), [](const auto& a, const auto& b) {
+          return a.count < b.count;
+        });
+      m_threshold.store(min->count, std::memory_order_relaxed);
+    }
+  }
+
+  /// The top of the last complete window, most frequent first.
+  Top top()
+  {
+    rotate(now());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_last;
+  }
+
+private:
+  static constexpr std::size_t DEPTH = 4;
+  static constexpr std::size_t WIDTH = 2048;
+
+  static std::int64_t now()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+  }
+
+  /// Starts a new window once the current one is over. Increments racing
+  /// with the reset may be lost or counted in the new window.
+  void rotate(std::int64_t t)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::int64_t end = m_end.load(std::memory_order_relaxed);
+    if (t < end)
+      return;
+    m_last.clear();
+    // an idle window in between leaves nothing to report
+    if (t < end + m_window) {
+      m_last.swap(m_top);
+      std::sort(m_last.begin(), m_last.end(), [](const auto& a, const auto& b) {
+        return a.count > b.count;
+      });
+    }
+    m_top.clear();
+    for (auto& counter : m_counts) {
+      counter.store(0, std::memory_order_relaxed);
+    }
+    m_threshold.store(0, std::memory_order_relaxed);
+    m_end.store(t + m_window, std::memory_order_relaxed);
+  }
+
+  const std::size_t m_k;
+  const std::int64_t m_window;
+  std::array<std::atomic<std::uint32_t>, DEPTH * WIDTH> m_counts{};
+  /// smallest count in a full top, below which keys cannot enter it
+  std::atomic<std::uint32_t> m_threshold{ 0 };
+  /// end of the current window, in steady clock ns
+  std::atomic<std::int64_t> m_end{ 0 };
+  std::mutex m_mutex;
+  Top m_top;
+  Top m_last;
+};
+
+/// The hot keys of one direction, see MessageBroker::trackHotKeys().
+struct HotKeyStage
+{
+  HotKeys routing_keys;
+  HotKeys types;
+
+  HotKeyStage(std::size_t k, std::chrono::milliseconds window)
+    : routing_keys(k, window)
+    , types(k, window)
+  {
+  }
+
+  MessageBroker::Metrics::HotKeys metrics()
+  {
+    return { routing_keys.top(), types.top() };
+  }
+};
+
+struct MessageBroker::ConsumerGroup
+{
+  /// handler times, bucket `i` counts the times below 2^i microseconds
+  using Histogram = std::array<std::atomic<std::uint64_t>, 32>;
+
+  Configuration cfg;
+  std::function<void(AmqpChannel::Ptr, const AmqpEnvelope&)> handler;
+  std::atomic<std::uint64_t> delivered{ 0 };
+  std::atomic<std::int64_t> handler_ns{ 0 };
+  Histogram handler_histogram{};
+  std::atomic<std::uint16_t> prefetch{ 0 };
+  std::atomic<std::int64_t> rtt_ns{ 0 };
+  std::unique_ptr<Deduplicator> dedupe;
+  std::atomic<std::uint64_t> duplicates{ 0 };
+  std::atomic<std::uint64_t> expired{ 0 };
+  std::atomic<std::uint64_t> filtered{ 0 };
+  std::atomic<std::uint64_t> failed{ 0 };
+  std::atomic<std::uint64_t> retried{ 0 };
+  std::atomic<std::uint64_t> dead_lettered{ 0 };
+  std::atomic<std::uint64_t> dropped{ 0 };
+  std::atomic<std::uint64_t> retry_errors{ 0 };
+  std::atomic<std::uint64_t> resubscribed{ 0 };
+  std::atomic<std::uint64_t> connection_errors{ 0 };
+
+  // guarded by Impl::monitor_mutex
+  std::string queue;
+  std::size_t consumers = 0;
+  std::array<std::uint64_t, 32> sampled_histogram{};
+  std::chrono::nanoseconds handler_p90{ 0 };
+};
+
+struct MessageBroker::Impl
+{
+  std::string host;
+  int port;
+  std::string username;
+  std::string password;
+  std::string vhost;
+  int frame_max;
+  std::atomic<bool> close{ false };
+  std::mutex topology_mutex;
+  std::unordered_set<std::string> topology_fingerprints;
+  /// destinations bound to each fanout exchange by publish(), by exchange
+  std::map<std::string, std::set<std::string>> fanout_destinations;
+
+  /// guards the members below
+  mutable std::mutex monitor_mutex;
+  /// notified on every sample and on close
+  std::condition_variable monitor_cv;
+  std::thread monitor_thread;
+  std::chrono::milliseconds monitor_interval{ 1000 };
+  std::set<std::string> monitored;
+  std::map<std::string, QueueStats> queue_stats;
+  std::vector<std::shared_ptr<ConsumerGroup>> subscriptions;
+  /// consumer threads
+  std::vector<std::thread> threads;
+  /// consumers which stopped after scaling down and are about to exit, to
+  /// be joined by reap()
+  std::vector<std::thread::id> retired;
+
+  /// see onReturn(), guarded by return_mutex
+  std::mutex return_mutex;
+  std::function<void(const AmqpReturn&)> on_return;
+  std::atomic<std::uint64_t> returned{ 0 };
+
+  /// flow control of the publishing connections, see watch()
+  std::mutex flow_mutex;
+  /// notified once no connection is blocked, and on close
+  std::condition_variable flow_cv;
+  /// number of connections blocked
+  std::size_t blocked = 0;
+  std::string blocked_reason;
+  std::chrono::steady_clock::time_point blocked_since;
+  std::chrono::nanoseconds blocked_time{ 0 };
+
+  /// see trackHotKeys(); stages replaced by a later call are kept until
+  /// destruction, as other threads may still be counting in them
+  std::atomic<HotKeyStage*> hot_published{ nullptr };
+  std::atomic<HotKeyStage*> hot_consumed{ nullptr };
+  std::vector<std::unique_ptr<HotKeyStage>> hot_stages;
+
+  /// see adaptFrames(); bucket `i` counts the bodies below 2^i bytes
+  std::atomic<bool> adapt{ false };
+  std::array<std::atomic<std::uint64_t>, 32> sizes{};
+  /// largest encoded properties seen
+  std::atomic<std::uint64_t> header_size{ 0 };
+  std::string profile;
+  /// largest frame_max asked for, the broker's limit once learned
+  std::atomic<int> max_frame{ 0 };
+
+  /// a message waiting for the batching thread, see Configuration::batching
+  struct Pending
+  {
+    /// the exchange, queue and routing keys of the configuration
+    std::string key;
+    /// configuration to declare, set on the first publish of `key` only
+    std::shared_ptr<const Configuration> cfg;
+    std::string routing_key;
+    Message message;
+    bool mandatory;
+    std::chrono::steady_clock::time_point enqueued;
+    std::chrono::microseconds max_delay;
+    std::size_t max_messages;
+    /// Configuration::blocked.max_wait, bounding the writes of the batch
+    std::chrono::milliseconds max_wait;
+    /// bodies put in `store` by the publish, removed if the message fails
+    amqp::AmqpBlobStore::Ptr store;
+    std::vector<std::string> claims;
+  };
+
+  /// a batching thread with its own connection
+  struct Lane
+  {
+    /// guards the members below
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    std::deque<Pending> pending;
+    /// keys whose configuration was handed to the batching thread
+    std::unordered_set<std::string> keys;
+    std::chrono::steady_clock::time_point last_publish;
+    Metrics::Publisher publisher;
+  };
+
+  /// the default lane and the priority lane
+  Lane lanes[2];
+
+  /// state of the asynchronous calls, only used by the thread in run()
+  struct Async
+  {
+    AmqpConnection::Ptr conn;
+    AmqpChannel::Ptr channel;
+    /// declared configurations with their exchange and queue, by key
+    std::map<std::string,
+             std::tuple<std::shared_ptr<const Configuration>,
+                        std::string,
+                        std::string>>
+      targets;
+    /// consumer of the direct reply-to pseudo queue
+    std::string reply_consumer;
+
+    struct Call
+    {
+      std::shared_ptr<const Configuration> cfg;
+      std::chrono::steady_clock::time_point deadline;
+      std::function<void(Response::Ptr)> done;
+    };
+    /// pending calls, by correlation id
+    std::map<std::string, Call> calls;
+
+    struct Consumer
+    {
+      std::shared_ptr<const Configuration> cfg;
+      std::function<void(const Message&, std::uint64_t)> callback;
+      /// acknowledged by ackAsync() instead of once the callback returned
+      bool manual = true;
+    };
+    /// subscriptions, by consumer tag
+    std::map<std::string, Consumer> consumers;
+    /// consumer tags cancelled by cancelAsync(), whose late deliveries are
+    /// requeued; cleared once no frame is left to read
+    std::set<std::string> cancelled;
+
+    struct Unacked
+    {
+      std::shared_ptr<const Configuration> cfg;
+      /// the properties, for check_done()
+      Message message;
+    };
+    /// deliveries of manual consumers, by delivery tag
+    std::map<std::uint64_t, Unacked> unacked;
+    /// prefetch of the consumers started next on the channel
+    std::uint16_t prefetch = 0;
+
+    /// operations deferred by a rate limit, by due time
+    std::multimap<std::chrono::steady_clock::time_point,
+                  std::function<void()>>
+      timers;
+
+    /// Sets the prefetch of the consumer started next.
+    void qos(const Configuration& cfg)
+    {
+      std::uint16_t count = cfg.consumer.no_ack ? 0 : cfg.consumer.prefetch;
+      if (count == prefetch)
+        return;
+      channel->basicQos(0, count, false);
+      prefetch = count;
+    }
+
+    std::vector<std::function<void()>> completions;
+    /// whether mandatory messages were published, whose returns are read
+    /// even without calls or subscriptions
+    bool mandatory = false;
+  } async;
+};
+
+MessageBroker::MessageBroker(const std::string& host,
+                             int port,
+                             const std::string& username,
+                             const std::string& password,
+                             const std::string& vhost,
+                             int frame_max)
+  : m_impl(new Impl)
+{
+  std::srand(std::time(NULL));
+
+  if (host.empty()) {
+    throw std::runtime_error("host is not specified, it is required");
+  }
+  if (vhost.empty()) {
+    throw std::runtime_error("vhost is not specified, it is required");
+  }
+  if (port <= 0) {
+    throw std::runtime_error(
+      "port is not valm_id, it must be a positive number");
+  }
+
+  m_impl->host = host;
+  m_impl->port = port;
+  m_impl->username = username;
+  m_impl->password = password;
+  m_impl->vhost = vhost;
+  m_impl->frame_max = frame_max;
+}
+
+MessageBroker::MessageBroker(const std::string& url, int frame_max)
+  : m_impl(new Impl)
+{
+  std::srand(std::time(NULL));
+
+  struct amqp_connection_info ci;
+  char* p = strdup(url.c_str());
+
+  die_on_error(amqp_parse_url(p, &ci), "Parsing URL");
+
+  m_impl->host = ci.host;
+  m_impl->port = ci.port;
+  m_impl->username = ci.user;
+  m_impl->password = ci.password;
+  m_impl->vhost = ci.vhost;
+  m_impl->frame_max = frame_max;
+
+  free(p);
+}
+
+MessageBroker::~MessageBroker()
+{
+  close();
+}
+
+const std::string
+MessageBroker::generateRandomString()
+{
+  static const char ALPHABET[] = { "0123456789"
+                                   "abcdefgjhiklmnopqrstvwxyz"
+                                   "ABCDEFGJHIKLMNOPQRSTVWXYZ" };
+  std::string result;
+  for (std::size_t i = 0; i < 16; i++) {
+    result += ALPHABET[rand() % (sizeof(ALPHABET) - 1)];
+  }
+  return result;
+}
+
+const char* MessageBroker::MESSAGE_TYPE_REQUEST = "request";
+
+const char* MessageBroker::MESSAGE_TYPE_RESPONSE = "response";
+
+const char* MessageBroker::MESSAGE_TYPE_ERROR = "error";
+
+MessageBroker::RateLimit::RateLimit(double rate, double burst)
+{
+  if (rate <= 0) {
+    throw std::runtime_error("rate limit must be a positive number");
+  }
+  m_interval = std::chrono::nanoseconds(std::int64_t(1e9 / rate));
+  m_tolerance = std::chrono::nanoseconds(
+    std::int64_t(m_interval.count() * std::max(burst, 1.0)));
+}
+
+std::chrono::nanoseconds
+MessageBroker::RateLimit::reserve(bool wait)
+{
+  std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                       .count();
+  std::int64_t tat = m_tat.load(std::memory_order_relaxed);
+  for (;;) {
+    std::int64_t next = std::max(tat, now) + m_interval.count();
+    std::chrono::nanoseconds delay(next - now - m_tolerance.count());
+    if (delay.count() > 0 && !wait)
+      return delay;
+    if (m_tat.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+      return std::max(delay, std::chrono::nanoseconds(0));
+  }
+}
+
+void
+MessageBroker::RateLimit::acquire()
+{
+  auto delay = reserve(true);
+  if (delay.count() > 0)
+    std::this_thread::sleep_for(delay);
+}
+
+bool
+MessageBroker::RateLimit::tryAcquire(std::chrono::nanoseconds* wait)
+{
+  auto delay = reserve(false);
+  if (wait)
+    *wait = delay;
+  return delay.count() == 0;
+}
+
+/// The frame_max carrying the 99th percentile of the body sizes in @p sizes
+/// in one frame, and a header frame of @p header bytes of properties, at
+/// most @p max; and the socket buffer size holding two such bodies (0 when
+/// the kernel's default is enough).
+static std::pair<int, int>
+fit_frames(const std::array<std::uint64_t, 32>& sizes,
+           std::uint64_t header,
+           int max)
+{
+  std::uint64_t total = 0;
+  for (auto count : sizes) {
+    total += count;
+  }
+  if (total == 0)
+    return { max, 0 };
+
+  std::size_t bucket = 0;
+  for (std::uint64_t seen = sizes[0]; seen * 100 < total * 99;) {
+    seen += sizes[++bucket];
+  }
+  // frame header and end take 8 bytes; a header frame, which is never
+  // split, adds class id, weight and body size to the properties
+  std::uint64_t body = (1ull << bucket) - 1;
+  std::uint64_t payload = std::max<std::uint64_t>(body, header + 14);
+  std::uint64_t frame = (payload + 8 + 4095) / 4096 * 4096;
+  int frame_max = int(std::min<std::uint64_t>(frame, std::max(max, 4096)));
+  int buffer = int(std::min<std::uint64_t>(2 * (body + 8), 16 << 20));
+  return { frame_max, buffer > 64 * 1024 ? buffer : 0 };
+}
+
+/// Identifies what @p cfg declares, for declaring it once only.
+static std::string
+configuration_key(const MessageBroker::Configuration& cfg)
+{
+  return cfg.exchange.name + '\0' + cfg.exchange.type + '\0' +
+         cfg.queue.name + '\0' + cfg.routing_key + '\0' +
+         cfg.routing_pattern;
+}
+
+void
+MessageBroker::publish(const Configuration& cfg, Message msg)
+{
+  ClaimCheck claim_check(cfg);
+  claim_check.checkIn(msg);
+  if (!msg.properties().content_type.has_value())
+    msg.properties().content_type = "application/json";
+  if (!msg.properties().delivery_mode.has_value())
+    msg.properties().delivery_mode = 2u;
+
+  record(false, cfg.routing_key, msg);
+  throttle(cfg);
+  bool spool = admit(cfg, true);
+  if ((spool || cfg.batching.enabled) &&
+      enqueue(cfg, msg, spool, claim_check.references()))
+    return;
+
+  AmqpConnection::Ptr conn = connectPublisher(cfg.blocked.max_wait);
+
+  AmqpChannel::Ptr channel = AmqpChannel::createInstance(conn);
+  channel->setReturnHandler(
+    [this](const AmqpReturn& message) { handleReturn(message); });
+  auto [exchange, queue] = setup(cfg, channel);
+  // a return is read while the channel is closed, without waiting for it
+  channel->basicPublish(exchange, cfg.routing_key, msg, cfg.mandatory);
+  claim_check.commit();
+
+  // connection.blocked comes while waiting for channel.close-ok, which a
+  // blocked broker never sends
+  channel.reset();
+  if (conn->blocked()) {
+    throw std::runtime_error("Publishing: connection blocked by the broker, "
+                             "the message may not be delivered");
+  }
+}
+
+bool
+MessageBroker::enqueue(const Configuration& cfg,
+                       Message& msg,
+                       bool spool,
+                       std::vector<std::string>& claims)
+{
+  std::size_t index = cfg.batching.priority ? 1 : 0;
+  auto& lane = m_impl->lanes[index];
+  std::lock_guard<std::mutex> lock(lane.mutex);
+  // published synchronously once closed, the batching thread is gone
+  if (m_impl->close)
+    return false;
+  // a batched publish while the broker is not blocked is not spooled
+  if (spool && lane.pending.size() >= cfg.blocked.max_spool) {
+    throw std::runtime_error(
+      "Publishing: connection blocked by the broker, spool is full");
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  auto& publisher = lane.publisher;
+  if (lane.last_publish.time_since_epoch().count()) {
+    std::chrono::nanoseconds gap =
+      std::min<std::chrono::steady_clock::duration>(now - lane.last_publish,
+                                                    std::chrono::seconds(1));
+    publisher.arrival_gap += (gap - publisher.arrival_gap) / 8;
+  } else {
+    // idle until proven otherwise
+    publisher.arrival_gap = std::chrono::seconds(1);
+  }
+  lane.last_publish = now;
+
+  Impl::Pending pending;
+  pending.key = configuration_key(cfg);
+  if (lane.keys.insert(pending.key).second)
+    pending.cfg = std::make_shared<const Configuration>(cfg);
+  pending.routing_key = cfg.routing_key;
+  pending.message = std::move(msg);
+  pending.mandatory = cfg.mandatory;
+  pending.enqueued = now;
+  pending.max_delay = cfg.batching.max_delay;
+  pending.max_messages = std::max<std::size_t>(cfg.batching.max_messages, 1);
+  pending.max_wait = cfg.blocked.max_wait;
+  if (!claims.empty()) {
+    pending.store = cfg.claim_check.store;
+    pending.claims = std::exchange(claims, {});
+  }
+  lane.pending.push_back(std::move(pending));
+
+  if (!lane.thread.joinable())
+    lane.thread = std::thread([this, index]() { flush(index); });
+  lane.cv.notify_one();
+  return true;
+}
+
+void
+MessageBroker::flush(std::size_t index)
+{
+  auto& lane = m_impl->lanes[index];
+  AmqpConnection::Ptr conn;
+  AmqpChannel::Ptr channel;
+  std::map<std::string, std::string> exchanges;
+  std::vector<AmqpPublication> batch;
+  auto& publisher = lane.publisher;
+  // returns arrive about a round trip after their message, they are polled
+  // for until then while the lane is idle
+  static const auto RETURN_WINDOW = std::chrono::seconds(1);
+  static const auto RETURN_POLL = std::chrono::milliseconds(10);
+  // how long a blocked lane waits on the socket before it looks at close()
+  static const auto BLOCKED_POLL = std::chrono::milliseconds(100);
+  std::chrono::steady_clock::time_point returns_until;
+  auto poll_returns = [&](std::chrono::milliseconds timeout) {
+    struct timeval tv = { time_t(timeout.count() / 1000),
+                          suseconds_t(timeout.count() % 1000 * 1000) };
+    try {
+      channel->pollReturns(&tv);
+    } catch (const std::runtime_error&) {
+      channel.reset();
+      conn.reset();
+    }
+  };
+
+  // the bodies of failed messages, which no consumer will fetch
+  auto unclaim = [](const Impl::Pending& pending) {
+    for (const auto& reference : pending.claims) {
+      try {
+        pending.store->remove(reference);
+      } catch (const std::runtime_error&) {
+        // the publish failed already, this error is not the one to report
+      }
+    }
+  };
+
+  std::unique_lock<std::mutex> lock(lane.mutex);
+  for (;;) {
+    // a blocked connection holds the pending messages, waiting on the
+    // socket for connection.unblocked
+    while (!m_impl->close && channel &&
+           (conn->blocked() ||
+            (lane.pending.empty() &&
+             std::chrono::steady_clock::now() < returns_until))) {
+      if (conn->blocked()) {
+        lock.unlock();
+        poll_returns(BLOCKED_POLL);
+        lock.lock();
+        continue;
+      }
+      lane.cv.wait_for(lock, RETURN_POLL);
+      lock.unlock();
+      poll_returns(std::chrono::milliseconds(0));
+      lock.lock();
+    }
+    lane.cv.wait(lock,
+                 [&]() { return !lane.pending.empty() || m_impl->close; });
+    if (channel && conn->blocked()) {
+      // closed while blocked: writing would hang
+      publisher.failed += lane.pending.size();
+      for (const auto& pending : lane.pending) {
+        unclaim(pending);
+      }
+      lane.pending.clear();
+    }
+    if (lane.pending.empty())
+      break;
+
+    // Nagle with a latency cap: while publishes arrive faster than the cap
+    // the batch is held open for more, up to the first message's deadline.
+    // At lower rates waiting would only add latency, so it is written at
+    // once.
+    auto deadline = lane.pending.front().enqueued;
+    auto max_delay = lane.pending.front().max_delay;
+    auto max_messages = lane.pending.front().max_messages;
+    if (publisher.arrival_gap < max_delay && !m_impl->close) {
+      lane.cv.wait_until(lock, deadline + max_delay, [&]() {
+        return lane.pending.size() >= max_messages || m_impl->close;
+      });
+    }
+
+    auto count = std::min(lane.pending.size(), max_messages);
+    std::vector<Impl::Pending> taken(
+      std::make_move_iterator(lane.pending.begin()),
+      std::make_move_iterator(lane.pending.begin() + count));
+    lane.pending.erase(lane.pending.begin(), lane.pending.begin() + count);
+    lock.unlock();
+
+    auto written = std::chrono::steady_clock::now();
+    bool failed = false;
+    try {
+      if (!channel) {
+        conn = connectPublisher(taken.front().max_wait);
+        channel = AmqpChannel::createInstance(conn);
+        channel->setReturnHandler(
+          [this](const AmqpReturn& message) { handleReturn(message); });
+      }
+      for (auto& pending : taken) {
+        if (pending.cfg)
+          exchanges[pending.key] = std::get<0>(setup(*pending.cfg, channel));
+        if (pending.mandatory)
+          returns_until = written + RETURN_WINDOW;
+        batch.push_back({ exchanges[pending.key],
+                          pending.routing_key,
+                          std::move(pending.message),
+                          pending.mandatory });
+      }
+      channel->basicPublish(batch);
+      struct timeval tv = { 0, 0 };
+      channel->pollReturns(&tv);
+    } catch (const std::runtime_error&) {
+      failed = true;
+      channel.reset();
+      conn.reset();
+    }
+    batch.clear();
+    if (failed) {
+      for (const auto& pending : taken) {
+        unclaim(pending);
+      }
+    }
+
+    lock.lock();
+    if (failed) {
+      publisher.failed += count;
+      // declared again by their next publish
+      for (const auto& pending : taken) {
+        lane.keys.erase(pending.key);
+      }
+    } else {
+      publisher.messages += count;
+    }
+    publisher.batches++;
+    publisher.batch_size += (double(count) - publisher.batch_size) / 8;
+    std::chrono::nanoseconds delay = written - taken.front().enqueued;
+    publisher.delay += (delay - publisher.delay) / 8;
+  }
+}
+
+void
+MessageBroker::publish(const Configuration& cfg,
+                       const std::vector<std::string>& destinations,
+                       Message msg)
+{
+  Topology topology;
+  Configuration::Exchange fanout = cfg.exchange;
+  fanout.type = AmqpChannel::EXCHANGE_TYPE_FANOUT;
+  if (fanout.name.empty()) {
+    // FNV-1a, so that every process derives the same name for a set
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const auto& destination : destinations) {
+      for (char c : destination + '\0') {
+        hash = (hash ^ std::uint8_t(c)) * 1099511628211ull;
+      }
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "fanout.%016llx", (unsigned long long)hash);
+    fanout.name = name;
+  }
+  topology.exchanges.push_back(fanout);
+  for (const auto& destination : destinations) {
+    Binding binding;
+    binding.source = fanout.name;
+    binding.destination = destination;
+    binding.exchange = true;
+    topology.bindings.push_back(binding);
+  }
+
+  // destinations dropped since the last call keep their binding otherwise
+  std::vector<Binding> stale;
+  {
+    std::lock_guard<std::mutex> lock(m_impl->topology_mutex);
+    auto& bound = m_impl->fanout_destinations[fanout.name];
+    for (const auto& destination : bound) {
+      if (std::find(destinations.begin(), destinations.end(), destination) !=
+          destinations.end())
+        continue;
+      Binding binding;
+      binding.source = fanout.name;
+      binding.destination = destination;
+      binding.exchange = true;
+      stale.push_back(binding);
+      // bound again if listed again
+      m_impl->topology_fingerprints.erase(binding_fingerprint(binding));
+    }
+    bound = std::set<std::string>(destinations.begin(), destinations.end());
+  }
+  if (!stale.empty()) {
+    auto conn = connect();
+    auto channel = AmqpChannel::createInstance(conn);
+    for (const auto& binding : stale) {
+      channel->exchangeUnbind(
+        binding.destination, binding.source, binding.routing_key);
+    }
+  }
+
+  // only declared by the first call, see declare(const Topology&)
+  declare(topology);
+
+  AmqpConnection::Ptr conn = connectPublisher(cfg.blocked.max_wait);
+
+  AmqpChannel::Ptr channel = AmqpChannel::createInstance(conn);
+  channel->setReturnHandler(
+    [this](const AmqpReturn& message) { handleReturn(message); });
+
+  ClaimCheck claim_check(cfg);
+  claim_check.checkIn(msg);
+  if (!msg.properties().content_type.has_value())
+    msg.properties().content_type = "application/json";
+  if (!msg.properties().delivery_mode.has_value())
+    msg.properties().delivery_mode = 2u;
+
+  record(false, cfg.routing_key, msg);
+  throttle(cfg);
+  admit(cfg, false);
+  channel->basicPublish(fanout.name, cfg.routing_key, msg, cfg.mandatory);
+  claim_check.commit();
+}
+
+MessageBroker::Response::Ptr
 MessageBroker::publish(const Configuration& cfg,
                        Request req,
                        struct timeval* timeout)
 {
-  auto conn = AmqpConnection::createInstance();
-  conn->open(m_impl->host, m_impl->port);
-  conn->login(
-    m_impl->vhost, m_impl->username, m_impl->password, m_impl->frame_max);
+  auto conn = connectPublisher(cfg.blocked.max_wait);
+
+  auto channel = AmqpChannel::createInstance(conn);
+  channel->setReturnHandler(
+    [this](const AmqpReturn& message) { handleReturn(message); });
+  auto [exchange, reply_to] = setup(cfg, channel);
+
+  ClaimCheck claim_check(cfg);
+  claim_check.checkIn(req);
+  if (!req.properties().content_type.has_value())
+    req.properties().content_type = "application/json";
+  if (!req.properties().delivery_mode.has_value())
+    req.properties().delivery_mode = 2u;
+  if (!req.properties().reply_to.has_value())
+    req.properties().reply_to = reply_to;
+  if (!req.properties().correlation_id.has_value())
+    req.properties().correlation_id = generateRandomString();
+  if (!req.properties().type.has_value())
+    req.properties().type = MESSAGE_TYPE_REQUEST;
+
+  record(false, cfg.routing_key, req);
+  throttle(cfg);
+  admit(cfg, false);
+  // a returned request ends the wait for its response
+  channel->basicPublish(exchange, cfg.routing_key, req, cfg.mandatory);
+  claim_check.commit();
+  channel->basicConsume(reply_to);
+
+  struct timeval tv = { 30, 0 };
+  Response::Ptr res;
+
+  for (;;) {
+    auto envelope = channel->basicConsumeMessage(timeout ? timeout : &tv);
+    if (!envelope && !channel->isOpen())
+      die("Waiting for response: channel closed by the broker");
+    if (!envelope)
+      return nullptr;
+    envelope = check_out(cfg, envelope);
+    res = Response::createInstance();
+    static_cast<Message&>(*res) = envelope->message();
+    break;
+  }
+
+  return res;
+}
+
+void
+MessageBroker::subscribe(const Configuration& cfg,
+                         std::function<void(const Message&)> callback)
+{
+  consume(cfg, [callback](AmqpChannel::Ptr, const AmqpEnvelope& envelope) {
+    callback(envelope.message());
+  });
+}
+
+void
+MessageBroker::subscribe(
+  const Configuration& cfg,
+  std::function<bool(const Request&, Response&)> callback)
+{
+  consume(cfg, [callback](AmqpChannel::Ptr channel,
+                          const AmqpEnvelope& envelope) {
+    Request req;
+    static_cast<Message&>(req) = envelope.message();
+    Response res;
+
+    auto ok = callback(req, res);
+    std::string reply_to(req.properties().reply_to.value());
+    std::string correlation_id(req.properties().correlation_id.value());
+
+    if (!res.properties().content_type.has_value())
+      res.properties().content_type = "application/json";
+    if (!res.properties().delivery_mode.has_value())
+      res.properties().delivery_mode = 2u;
+    if (!res.properties().correlation_id.has_value())
+      res.properties().correlation_id = correlation_id;
+    if (!res.properties().type.has_value())
+      res.properties().type = ok ? MESSAGE_TYPE_RESPONSE : MESSAGE_TYPE_ERROR;
+
+    channel->basicPublish("", reply_to, res);
+  });
+}
+
+void
+MessageBroker::consume(
+  const Configuration& cfg,
+  std::function<void(AmqpChannel::Ptr, const AmqpEnvelope&)> handler)
+{
+  auto group = std::make_shared<ConsumerGroup>();
+  group->cfg = cfg;
+  group->handler = handler;
+  if (cfg.dedupe.enabled) {
+    const auto& dedupe = cfg.dedupe;
+    group->dedupe = std::make_unique<Deduplicator>(dedupe.window,
+                                                   dedupe.capacity,
+                                                   dedupe.false_positive_rate,
+                                                   dedupe.exact);
+  }
+
+  reap();
+  std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+  m_impl->subscriptions.push_back(group);
+  auto consumers = std::max<std::size_t>(cfg.consumer.scaling.min, 1);
+  if (cfg.queue.name.empty())
+    consumers = 1;
+  for (std::size_t i = 0; i < consumers; i++) {
+    spawn(group);
+  }
+  // scaling up is decided on queue samples
+  if (consumers < cfg.consumer.scaling.max && !cfg.queue.name.empty())
+    sample({});
+}
+
+void
+MessageBroker::reap()
+{
+  // joined without the lock: a handler called while a consumer drains may
+  // publish or read metrics, which take it
+  std::vector<std::thread> finished;
+  {
+    std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+    for (auto id : m_impl->retired) {
+      auto it = std::find_if(
+        m_impl->threads.begin(),
+        m_impl->threads.end(),
+        [id](const std::thread& thread) { return thread.get_id() == id; });
+      if (it == m_impl->threads.end())
+        continue;
+      finished.push_back(std::move(*it));
+      m_impl->threads.erase(it);
+    }
+    m_impl->retired.clear();
+  }
+  for (auto& thread : finished) {
+    thread.join();
+  }
+}
+
+void
+MessageBroker::spawn(std::shared_ptr<ConsumerGroup> group)
+{
+  group->consumers++;
+  std::thread worker([this, group]() {
+    const auto& cfg = group->cfg;
+    struct timeval tv = { 1, 0 };
+    AmqpConnection::Ptr conn;
+    AmqpChannel::Ptr channel;
+    std::string queue;
+    std::string consumer_tag;
+
+    // basic.qos is synchronous, and doubles as a round trip measurement
+    std::uint16_t prefetch = 0;
+    std::chrono::nanoseconds rtt{ 0 };
+    auto qos = [&](std::uint16_t count) {
+      auto start = std::chrono::steady_clock::now();
+      channel->basicQos(0, count, false);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      rtt = rtt.count() ? (rtt * 7 + elapsed) / 8 : elapsed;
+      prefetch = count;
+      group->prefetch = count;
+      group->rtt_ns = rtt.count();
+    };
+    bool adaptive = cfg.consumer.adaptive_prefetch && !cfg.consumer.no_ack;
+    std::uint16_t initial_prefetch = 0;
+    if (adaptive)
+      initial_prefetch = std::max<std::uint16_t>(cfg.consumer.prefetch, 1);
+    else if (!cfg.consumer.no_ack)
+      initial_prefetch = cfg.consumer.prefetch;
+
+    // Declares the queue (it may have been deleted) and consumes from it.
+    auto subscribe = [&]() {
+      // a plain variable, as structured bindings cannot be captured by
+      // lambdas
+      queue = std::get<1>(setup(cfg, channel));
+      consumer_tag =
+        channel->basicConsume(queue, "", false, cfg.consumer.no_ack);
+      std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+      group->queue = queue;
+    };
+
+    // Opens a new connection, at start and once the current one failed,
+    // e.g. on a broker failover, with exponential backoff between attempts.
+    // The broker requeues the deliveries left unacked on the old one.
+    // Returns false when closed first.
+    auto reconnect = [&]() {
+      auto delay = cfg.consumer.resubscribe.min_delay;
+      while (!m_impl->close) {
+        try {
+          channel.reset();
+          conn.reset();
+          conn = connect();
+          channel = AmqpChannel::createInstance(conn);
+          if (prefetch || initial_prefetch)
+            qos(prefetch ? prefetch : initial_prefetch);
+          subscribe();
+          return true;
+        } catch (const std::runtime_error&) {
+          group->connection_errors++;
+        }
+        std::unique_lock<std::mutex> lock(m_impl->monitor_mutex);
+        m_impl->monitor_cv.wait_for(
+          lock, delay, [this]() { return m_impl->close.load(); });
+        delay = std::min(delay * 2, cfg.consumer.resubscribe.max_delay);
+      }
+      return false;
+    };
+
+    // Consumes anew once the broker cancelled the consumer, on a new channel
+    // if the broker closed this one; on a new connection if that fails.
+    auto resubscribe = [&]() {
+      try {
+        if (!channel->isOpen()) {
+          channel.reset();
+          channel = AmqpChannel::createInstance(conn);
+          if (prefetch)
+            qos(prefetch);
+        }
+        subscribe();
+      } catch (const std::runtime_error&) {
+        group->connection_errors++;
+        if (!reconnect())
+          return;
+      }
+      group->resubscribed++;
+    };
+
+    // what became of a failed delivery
+    enum Outcome
+    {
+      RETRIED,
+      DEAD_LETTERED,
+      DROPPED,
+      REQUEUED
+    };
+
+    // Republishes a failed delivery to the delay queue of its next attempt,
+    // or to the dead-letter exchange.
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point>
+      delay_queues;
+    auto retry = [&](const AmqpEnvelope& envelope) {
+      const auto& policy = cfg.retry;
+      AmqpMessage message = envelope.message();
+      auto& properties = message.properties();
+      std::int64_t attempts = 1;
+      if (properties.headers.has_value()) {
+        auto it = properties.headers->find(policy.header);
+        if (it != properties.headers->end())
+          attempts += table_integer(it->second).value_or(0);
+      } else {
+        properties.headers = AmqpTable();
+      }
+
+      // a server-named or exclusive queue is gone with the connection, and
+      // the messages of its delay queue with it
+      bool again = attempts < std::int64_t(policy.max_attempts) &&
+                   !cfg.queue.name.empty() && !cfg.queue.exclusive;
+      if (again) {
+        auto delay = std::chrono::milliseconds(std::int64_t(
+          policy.delay.count() * std::pow(policy.multiplier, attempts - 1)));
+        auto name = queue + ".retry." + std::to_string(delay.count());
+        // Deleted by the broker once unused for `expires`, e.g. after the
+        // queue's consumers left. Declaring it again within half of that
+        // keeps it alive past the delay of every message published to it.
+        auto expires = 2 * delay + std::chrono::minutes(1);
+        auto now = std::chrono::steady_clock::now();
+        auto declared = delay_queues.find(name);
+        if (declared == delay_queues.end() ||
+            now - declared->second >= expires / 2) {
+          // expired messages go back to the queue through the default
+          // exchange
+          AmqpTable arguments{
+            { "x-dead-letter-exchange", "" },
+            { "x-dead-letter-routing-key", queue },
+            { "x-expires", std::int64_t(expires.count()) }
+          };
+          channel->queueDeclare(
+            name, false, cfg.queue.durable, false, false, arguments);
+          delay_queues[name] = now;
+        }
+        properties.headers->insert_or_assign(policy.header, attempts);
+        properties.expiration = std::to_string(delay.count());
+        channel->basicPublish("", name, message);
+      } else if (!policy.dead_letter_exchange.empty()) {
+        properties.headers->insert_or_assign(policy.header, attempts);
+        channel->basicPublish(
+          policy.dead_letter_exchange, envelope.routingKey(), message);
+      } else if (!cfg.consumer.no_ack) {
+        channel->basicNack(envelope.deliveryTag(), false, false);
+        return DEAD_LETTERED;
+      } else {
+        // already acknowledged by the broker, there is nothing to reject
+        return DROPPED;
+      }
+      if (!cfg.consumer.no_ack)
+        channel->basicAck(envelope.deliveryTag());
+      return again ? RETRIED : DEAD_LETTERED;
+    };
+
+    // Rejects a failed delivery whose retry failed itself.
+    auto reject = [&](const AmqpEnvelope& envelope) {
+      if (cfg.consumer.no_ack)
+        return DROPPED;
+      // the broker requeues the unacked deliveries of a closed channel
+      if (!channel->isOpen())
+        return REQUEUED;
+      try {
+        channel->basicNack(envelope.deliveryTag(), false, false);
+        return DEAD_LETTERED;
+      } catch (const std::runtime_error&) {
+        return REQUEUED;
+      }
+    };
+
+    auto dispatch = [&](const AmqpEnvelope::Ptr& envelope) {
+      auto start = std::chrono::steady_clock::now();
+      record(true, envelope->routingKey(), envelope->message());
+      // before resolving a claim check, so that stale work costs nothing
+      if (cfg.expiry.enabled &&
+          is_expired(cfg, envelope->message().properties())) {
+        group->expired++;
+        if (cfg.expiry.action == EXPIRED_CALLBACK && cfg.expiry.callback) {
+          // handled as expired either way, like a failing handler's message
+          // is not redelivered to the same consumer
+          try {
+            cfg.expiry.callback(check_out(cfg, envelope)->message());
+          } catch (...) {
+          }
+        }
+        if (cfg.expiry.action == EXPIRED_NACK && !cfg.consumer.no_ack) {
+          channel->basicNack(envelope->deliveryTag(), false, false);
+          return;
+        }
+        if (!cfg.consumer.no_ack)
+          channel->basicAck(envelope->deliveryTag());
+        check_done(cfg, envelope->message());
+        return;
+      }
+      std::string key;
+      if (group->dedupe) {
+        // before resolving a claim check too, whose reference identifies the
+        // body; bodies are kept as a hash, for the ring to stay small
+        const auto& message = envelope->message();
+        const auto& properties = message.properties();
+        if (properties.message_id.has_value())
+          key = "id:" + properties.message_id.value();
+        else if (auto reference = claim_reference(message))
+          key = "claim:" + reference.value();
+        else
+          key = "body:" + std::to_string(std::hash<std::string_view>()(
+                            message.bodyView()));
+        if (!group->dedupe->acquire(key)) {
+          if (!cfg.consumer.no_ack)
+            channel->basicAck(envelope->deliveryTag());
+          check_done(cfg, envelope->message());
+          group->duplicates++;
+          return;
+        }
+      }
+      auto delivery = check_out(cfg, envelope);
+      try {
+        group->handler(channel, *delivery);
+      } catch (...) {
+        // remembered once handled only, as a failed delivery comes again
+        if (group->dedupe)
+          group->dedupe->release(key, false);
+        group->failed++;
+        Outcome outcome;
+        try {
+          outcome = retry(*envelope);
+        } catch (...) {
+          // e.g. a delay queue declared with other arguments, or a
+          // connection lost while republishing
+          group->retry_errors++;
+          outcome = reject(*envelope);
+        }
+        switch (outcome) {
+          case RETRIED:
+            group->retried++;
+            break;
+          case DEAD_LETTERED:
+            group->dead_lettered++;
+            break;
+          case DROPPED:
+            group->dropped++;
+            check_done(cfg, envelope->message());
+            break;
+          case REQUEUED:
+            break;
+        }
+        return;
+      }
+      if (group->dedupe)
+        group->dedupe->release(key, true);
+      if (!cfg.consumer.no_ack)
+        channel->basicAck(envelope->deliveryTag());
+      check_done(cfg, envelope->message());
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      auto us =
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+      std::size_t bucket = 0;
+      while (bucket + 1 < group->handler_histogram.size() && us >> bucket)
+        bucket++;
+      group->handler_histogram[bucket]++;
+      group->delivered++;
+      group->handler_ns +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    };
+
+    // Stops this consumer when it has been idle, unless the group is at its
+    // minimum size.
+    auto retire = [&]() {
+      std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+      auto min = std::max<std::size_t>(cfg.consumer.scaling.min, 1);
+      if (group->consumers <= min)
+        return false;
+      group->consumers--;
+      return true;
+    };
+    bool retired = false;
+
+    // time spent in handlers and waiting for deliveries since the last
+    // prefetch tuning
+    struct
+    {
+      std::chrono::steady_clock::time_point start;
+      std::chrono::nanoseconds busy{ 0 };
+      std::chrono::nanoseconds waited{ 0 };
+      std::uint64_t deliveries = 0;
+    } window;
+    window.start = std::chrono::steady_clock::now();
+
+    auto tune = [&]() {
+      bool backlog = false;
+      {
+        std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+        sample({});
+        auto it = m_impl->queue_stats.find(group->queue);
+        backlog =
+          it != m_impl->queue_stats.end() && it->second.message_count > 0;
+      }
+      // deliveries handled during one ack round trip keep the handler busy
+      auto handler_time = std::max<std::chrono::nanoseconds>(
+        window.busy / window.deliveries, std::chrono::nanoseconds(1));
+      std::uint64_t wanted = rtt / handler_time + 1;
+      // starved for more than 5% of the time although messages are ready
+      if (backlog && window.waited * 20 > window.busy)
+        wanted = std::max<std::uint64_t>(wanted, prefetch * 2u);
+      wanted = std::clamp<std::uint64_t>(
+        wanted, 1, std::max<std::uint16_t>(cfg.consumer.max_prefetch, 1));
+      // changes under 25% are not worth a round trip
+      if (wanted * 4 < prefetch * 3u || wanted * 4 > prefetch * 5u)
+        qos(static_cast<std::uint16_t>(wanted));
+
+      window = {};
+      window.start = std::chrono::steady_clock::now();
+    };
+
+    // filtered deliveries are skipped before their body is read
+    auto filter = [&](const AmqpDeliveryHead& head) {
+      if (cfg.filter(head))
+        return true;
+      group->filtered++;
+      return false;
+    };
+    auto next = [&](const struct timeval* timeout) {
+      if (!cfg.filter)
+        return channel->basicConsumeMessage(timeout);
+      return channel->basicConsumeMessage(
+        timeout, filter, !cfg.consumer.no_ack);
+    };
+
+    if (!reconnect())
+      return;
+
+    auto last = std::chrono::steady_clock::now();
+    while (!m_impl->close) {
+      try {
+        auto waiting = std::chrono::steady_clock::now();
+        auto envelope = next(&tv);
+        if (envelope) {
+          auto start = std::chrono::steady_clock::now();
+          dispatch(envelope);
+          last = std::chrono::steady_clock::now();
+          window.waited += start - waiting;
+          window.busy += last - start;
+          window.deliveries++;
+          if (adaptive && last - window.start >= std::chrono::seconds(1))
+            tune();
+        } else if (!channel->isOpen() ||
+                   channel->consumerCancelled(consumer_tag)) {
+          resubscribe();
+          last = std::chrono::steady_clock::now();
+        } else if (std::chrono::steady_clock::now() - last >=
+                     cfg.consumer.scaling.idle &&
+                   retire()) {
+          retired = true;
+          break;
+        }
+      } catch (const std::runtime_error&) {
+        // the connection failed, or an ack could not be written on it
+        group->connection_errors++;
+        if (!reconnect())
+          break;
+        last = std::chrono::steady_clock::now();
+      }
+    }
+
+    // Drain: once basic.cancel-ok is received the broker sends nothing more to
+    // this consumer, so every delivery still in flight is already buffered on
+    // the connection. Handle those instead of dropping them on close, which
+    // would lose them (no_ack) or have them redelivered elsewhere.
+    try {
+      if (channel && channel->isOpen() &&
+          !channel->consumerCancelled(consumer_tag)) {
+        channel->basicCancel(consumer_tag);
+        struct timeval immediately = { 0, 0 };
+        while (auto envelope = next(&immediately)) {
+          dispatch(envelope);
+        }
+      }
+    } catch (const std::runtime_error&) {
+      // the broker requeues what was not acked on the lost connection
+      group->connection_errors++;
+    }
+
+    if (retired) {
+      // closed first, so that joining this thread does not wait for the
+      // broker
+      channel.reset();
+      conn.reset();
+      std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+      m_impl->retired.push_back(std::this_thread::get_id());
+    }
+  });
+
+  m_impl->threads.push_back(std::move(worker));
+}
+
+void
+MessageBroker::scale()
+{
+  for (const auto& group : m_impl->subscriptions) {
+    // 90th percentile of the handler times since the last sample
+    std::array<std::uint64_t, 32> window;
+    std::uint64_t count = 0;
+    for (std::size_t i = 0; i < window.size(); i++) {
+      std::uint64_t total = group->handler_histogram[i];
+      window[i] = total - group->sampled_histogram[i];
+      group->sampled_histogram[i] = total;
+      count += window[i];
+    }
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; count && i < window.size(); i++) {
+      seen += window[i];
+      if (seen * 10 >= count * 9) {
+        group->handler_p90 = std::chrono::microseconds(1ull << i);
+        break;
+      }
+    }
+
+    const auto& scaling = group->cfg.consumer.scaling;
+    if (group->cfg.queue.name.empty() || group->consumers >= scaling.max)
+      continue;
+    auto it = m_impl->queue_stats.find(group->queue);
+    if (it == m_impl->queue_stats.end())
+      continue;
+
+    // consumers needed to work off the queue within max_latency
+    double backlog = std::chrono::duration<double, std::milli>(
+                       group->handler_p90 * it->second.message_count)
+                       .count();
+    auto wanted = static_cast<std::size_t>(
+      std::ceil(backlog / std::max<double>(scaling.max_latency.count(), 1)));
+    while (group->consumers < std::min(wanted, scaling.max)) {
+      spawn(group);
+    }
+  }
+}
+
+void
+MessageBroker::publishBatch(const Configuration& cfg,
+                            std::vector<Message> messages)
+{
+  auto conn = connectPublisher(cfg.blocked.max_wait);
+
+  auto channel = AmqpChannel::createInstance(conn);
+  channel->setReturnHandler(
+    [this](const AmqpReturn& message) { handleReturn(message); });
+  auto [exchange, queue] = setup(cfg, channel);
+
+  ClaimCheck claim_check(cfg);
+  std::vector<AmqpPublication> publications;
+  publications.reserve(messages.size());
+  for (auto& msg : messages) {
+    claim_check.checkIn(msg);
+    if (!msg.properties().content_type.has_value())
+      msg.properties().content_type = "application/json";
+    if (!msg.properties().delivery_mode.has_value())
+      msg.properties().delivery_mode = 2u;
+    record(false, cfg.routing_key, msg);
+    throttle(cfg);
+    publications.push_back(
+      { exchange, cfg.routing_key, std::move(msg), cfg.mandatory });
+  }
+
+  admit(cfg, false);
+  channel->txSelect();
+  try {
+    channel->basicPublish(publications);
+    channel->txCommit();
+    claim_check.commit();
+  } catch (const std::runtime_error&) {
+    // explicit, although closing the channel discards it as well
+    if (channel->isOpen()) {
+      try {
+        channel->txRollback();
+      } catch (const std::runtime_error&) {
+      }
+    }
+    throw;
+  }
+}
+
+std::size_t
+MessageBroker::drain(const Configuration& cfg,
+                     std::size_t max_messages,
+                     std::function<void(const Message&)> callback)
+{
+  auto conn = connect();
+
+  auto channel = AmqpChannel::createInstance(conn);
+  auto [exchange, queue] = setup(cfg, channel);
+
+  // one request first, whose reply tells how many messages are left
+  std::size_t handled = 0;
+  std::size_t window = 1;
+  for (;;) {
+    std::size_t count = window;
+    if (max_messages)
+      count = std::min(count, max_messages - handled);
+    if (count == 0)
+      break;
+
+    std::uint32_t left = 0;
+    auto envelopes =
+      channel->basicGet(queue, count, cfg.consumer.no_ack, &left);
+    for (const auto& envelope : envelopes) {
+      record(true, envelope->routingKey(), envelope->message());
+      callback(check_out(cfg, envelope)->message());
+      if (!cfg.consumer.no_ack)
+        channel->basicAck(envelope->deliveryTag());
+      check_done(cfg, envelope->message());
+      handled++;
+    }
+    if (envelopes.size() < count || left == 0)
+      break;
+    window = std::min<std::size_t>(left, 64);
+  }
+  return handled;
+}
+
+void
+MessageBroker::openAsync()
+{
+  auto& async = m_impl->async;
+  // a channel closed by the server is replaced by a new connection, with
+  // the declarations and subscriptions made again; calls in flight time out
+  auto consumers = std::move(async.consumers);
+  async.consumers.clear();
+  async.targets.clear();
+  async.reply_consumer.clear();
+  async.cancelled.clear();
+  async.unacked.clear();
+  async.prefetch = 0;
+
+  async.conn = connect();
+  watch(async.conn);
+  async.channel = AmqpChannel::createInstance(async.conn);
+  async.channel->setReturnHandler([this](const AmqpReturn& message) {
+    handleReturn(message);
+    // no response comes for a returned request
+    auto& async = m_impl->async;
+    const auto& id = message.message.properties().correlation_id;
+    auto it = async.calls.find(id.value_or(""));
+    if (it != async.calls.end()) {
+      auto done = std::move(it->second.done);
+      async.calls.erase(it);
+      async.completions.push_back([done]() { done(nullptr); });
+    }
+  });
+
+  // under their former tags, which cancelAsync() is given
+  for (auto& [tag, consumer] : consumers) {
+    auto queue = std::get<2>(prepare(*consumer.cfg));
+    async.qos(*consumer.cfg);
+    async.channel->basicConsume(
+      queue, tag, false, consumer.cfg->consumer.no_ack);
+    async.consumers[tag] = std::move(consumer);
+  }
+}
+
+std::tuple<std::shared_ptr<const MessageBroker::Configuration>,
+           std::string,
+           std::string>
+MessageBroker::prepare(const Configuration& cfg)
+{
+  auto& async = m_impl->async;
+  if (!async.channel || !async.channel->isOpen())
+    openAsync();
+
+  auto key = configuration_key(cfg);
+  auto it = async.targets.find(key);
+  if (it == async.targets.end()) {
+    auto [exchange, queue] = setup(cfg, async.channel);
+    auto target = std::make_shared<const Configuration>(cfg);
+    it = async.targets.emplace(key, std::make_tuple(target, exchange, queue))
+           .first;
+  }
+  return it->second;
+}
 
-  auto channel = AmqpChannel::createInstance(conn);
-  auto [exchange, reply_to] = setup(cfg, channel);
+void
+MessageBroker::publishAsync(const Configuration& cfg,
+                            Message msg,
+                            std::function<void()> done)
+{
+  // not waited for, which would stall run(): tried again once a token is
+  // due
+  std::chrono::nanoseconds wait;
+  if (cfg.rate_limit && !cfg.rate_limit->tryAcquire(&wait)) {
+    m_impl->async.timers.emplace(
+      std::chrono::steady_clock::now() + wait, [this, cfg, msg, done]() {
+        publishAsync(cfg, msg, done);
+      });
+    return;
+  }
+
+  auto [target, exchange, queue] = prepare(cfg);
+
+  ClaimCheck claim_check(cfg);
+  claim_check.checkIn(msg);
+  if (!msg.properties().content_type.has_value())
+    msg.properties().content_type = "application/json";
+  if (!msg.properties().delivery_mode.has_value())
+    msg.properties().delivery_mode = 2u;
+
+  record(false, cfg.routing_key, msg);
+  m_impl->async.channel->basicPublish(
+    exchange, cfg.routing_key, msg, cfg.mandatory);
+  claim_check.commit();
+  m_impl->async.mandatory |= cfg.mandatory;
+  if (done)
+    m_impl->async.completions.push_back(std::move(done));
+}
+
+void
+MessageBroker::callAsync(const Configuration& cfg,
+                         Request req,
+                         std::chrono::milliseconds timeout,
+                         std::function<void(Response::Ptr)> done)
+{
+  static const char* DIRECT_REPLY_TO = "amq.rabbitmq.reply-to";
+
+  auto& async = m_impl->async;
+  // deferred as by publishAsync(), within the same timeout
+  std::chrono::nanoseconds wait;
+  if (cfg.rate_limit && !cfg.rate_limit->tryAcquire(&wait)) {
+    auto left = std::max(
+      timeout - std::chrono::ceil<std::chrono::milliseconds>(wait),
+      std::chrono::milliseconds(0));
+    async.timers.emplace(std::chrono::steady_clock::now() + wait,
+                         [this, cfg, req, left, done]() {
+                           callAsync(cfg, req, left, done);
+                         });
+    return;
+  }
+  auto [target, exchange, queue] = prepare(cfg);
+  if (async.reply_consumer.empty()) {
+    async.reply_consumer =
+      async.channel->basicConsume(DIRECT_REPLY_TO, "", false, true);
+  }
 
+  ClaimCheck claim_check(cfg);
+  claim_check.checkIn(req);
   if (!req.properties().content_type.has_value())
     req.properties().content_type = "application/json";
   if (!req.properties().delivery_mode.has_value())
     req.properties().delivery_mode = 2u;
-  if (!req.properties().reply_to.has_value())
-    req.properties().reply_to = reply_to;
   if (!req.properties().correlation_id.has_value())
     req.properties().correlation_id = generateRandomString();
   if (!req.properties().type.has_value())
     req.properties().type = MESSAGE_TYPE_REQUEST;
+  req.properties().reply_to = DIRECT_REPLY_TO;
+
+  Impl::Async::Call call;
+  call.cfg = target;
+  call.deadline = std::chrono::steady_clock::now() + timeout;
+  call.done = std::move(done);
+  async.calls[req.properties().correlation_id.value()] = std::move(call);
+  record(false, cfg.routing_key, req);
+  async.channel->basicPublish(exchange, cfg.routing_key, req, cfg.mandatory);
+  claim_check.commit();
+  async.mandatory |= cfg.mandatory;
+}
 
-  channel->basicPublish(exchange, cfg.routing_key, req);
-  channel->basicConsume(reply_to);
+std::string
+MessageBroker::consumeAsync(const Configuration& cfg,
+                            std::function<void(const Message&)> callback)
+{
+  auto tag = consumeAsync(
+    cfg, [callback](const Message& msg, std::uint64_t) { callback(msg); });
+  m_impl->async.consumers[tag].manual = false;
+  return tag;
+}
 
-  struct timeval tv = { 30, 0 };
-  Response::Ptr res;
+std::string
+MessageBroker::consumeAsync(
+  const Configuration& cfg,
+  std::function<void(const Message&, std::uint64_t)> callback)
+{
+  auto& async = m_impl->async;
+  auto [target, exchange, queue] = prepare(cfg);
+  async.qos(cfg);
+  auto tag = async.channel->basicConsume(queue, "", false, cfg.consumer.no_ack);
+  async.consumers[tag] = { target, std::move(callback) };
+  return tag;
+}
 
-  for (;;) {
-    auto envelope = channel->basicConsumeMessage(timeout ? timeout : &tv);
-    if (!envelope)
-      return nullptr;
-    res = Response::createInstance();
-    res->body() = envelope->message().body();
-    res->properties() = envelope->message().properties();
-    break;
+void
+MessageBroker::ackAsync(std::uint64_t delivery_tag)
+{
+  auto& async = m_impl->async;
+  auto it = async.unacked.find(delivery_tag);
+  // with no_ack, or from a channel replaced since
+  if (it == async.unacked.end())
+    return;
+  auto unacked = std::move(it->second);
+  async.unacked.erase(it);
+  async.channel->basicAck(delivery_tag);
+  check_done(*unacked.cfg, unacked.message);
+}
+
+void
+MessageBroker::nackAsync(std::uint64_t delivery_tag, bool requeue)
+{
+  auto& async = m_impl->async;
+  if (!async.unacked.erase(delivery_tag))
+    return;
+  async.channel->basicNack(delivery_tag, false, requeue);
+}
+
+void
+MessageBroker::cancelAsync(const std::string& consumer_tag)
+{
+  auto& async = m_impl->async;
+  auto it = async.consumers.find(consumer_tag);
+  if (it == async.consumers.end())
+    return;
+  bool no_ack = it->second.cfg->consumer.no_ack;
+  async.consumers.erase(it);
+  // deliveries already on the wire are handed back by runOnce()
+  if (!no_ack)
+    async.cancelled.insert(consumer_tag);
+  async.channel->basicCancel(consumer_tag);
+}
+
+void
+MessageBroker::run()
+{
+  auto& async = m_impl->async;
+  while (!m_impl->close &&
+         (!async.completions.empty() || !async.calls.empty() ||
+          !async.consumers.empty() || !async.timers.empty())) {
+    runOnce(std::chrono::milliseconds(100));
   }
+}
 
-  return res;
+bool
+MessageBroker::runOnce(std::chrono::milliseconds timeout)
+{
+  auto& async = m_impl->async;
+  bool ran = false;
+
+  // a callback throwing does not lose the other completions of the round:
+  // the first exception is rethrown once they ran
+  std::exception_ptr error;
+  auto invoke = [&error](const std::function<void()>& callback) {
+    try {
+      callback();
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+      return false;
+    }
+    return true;
+  };
+
+  // completions queued by these run on the next round
+  auto completions = std::move(async.completions);
+  async.completions.clear();
+  for (auto& done : completions) {
+    invoke(done);
+    ran = true;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  while (!async.timers.empty() && async.timers.begin()->first <= now) {
+    auto timer = std::move(async.timers.begin()->second);
+    async.timers.erase(async.timers.begin());
+    invoke(timer);
+    ran = true;
+  }
+
+  if (async.channel && !async.channel->isOpen())
+    openAsync();
+
+  now = std::chrono::steady_clock::now();
+  if (ran)
+    timeout = std::chrono::milliseconds(0);
+  auto until = [&](std::chrono::steady_clock::time_point deadline) {
+    timeout = std::min(timeout,
+                       std::chrono::ceil<std::chrono::milliseconds>(
+                         std::max(deadline - now,
+                                  std::chrono::steady_clock::duration(0))));
+  };
+  for (const auto& [id, call] : async.calls) {
+    until(call.deadline);
+  }
+  if (!async.timers.empty())
+    until(async.timers.begin()->first);
+
+  if (async.channel &&
+      (!async.calls.empty() || !async.consumers.empty() || async.mandatory)) {
+    struct timeval tv = { time_t(timeout.count() / 1000),
+                          suseconds_t(timeout.count() % 1000 * 1000) };
+
+    if (auto envelope = async.channel->basicConsumeMessage(&tv)) {
+      ran = true;
+      if (envelope->consumerTag() == async.reply_consumer) {
+        const auto& properties = envelope->message().properties();
+        auto it = async.calls.find(properties.correlation_id.value_or(""));
+        if (it != async.calls.end()) {
+          auto call = std::move(it->second);
+          async.calls.erase(it);
+          auto res = Response::createInstance();
+          static_cast<Message&>(*res) =
+            check_out(*call.cfg, envelope)->message();
+          invoke([&]() { call.done(res); });
+        }
+      } else {
+        auto it = async.consumers.find(envelope->consumerTag());
+        if (it != async.consumers.end()) {
+          auto consumer = it->second;
+          auto tag = envelope->deliveryTag();
+          bool ack = !consumer.cfg->consumer.no_ack;
+          record(true, envelope->routingKey(), envelope->message());
+          if (ack && consumer.manual) {
+            Message done;
+            done.properties() = envelope->message().properties();
+            async.unacked[tag] = { consumer.cfg, std::move(done) };
+          }
+          bool handled = invoke([&]() {
+            consumer.callback(check_out(*consumer.cfg, envelope)->message(),
+                              tag);
+          });
+          // a message whose callback threw is rejected, as by a
+          // synchronous consumer without retry policy
+          if (!handled) {
+            async.unacked.erase(tag);
+            if (ack)
+              async.channel->basicNack(tag, false, false);
+          } else if (!consumer.manual) {
+            if (ack)
+              async.channel->basicAck(tag);
+            check_done(*consumer.cfg, envelope->message());
+          }
+        } else if (async.cancelled.count(envelope->consumerTag())) {
+          async.channel->basicNack(envelope->deliveryTag(), false, true);
+        }
+      }
+    }
+    now = std::chrono::steady_clock::now();
+
+    // the deliveries of a cancelled consumer came before its cancel-ok, so
+    // they were all read once nothing is left
+    if (!async.cancelled.empty() && !async.conn->hasPending())
+      async.cancelled.clear();
+  } else if (timeout.count() > 0 && !async.timers.empty()) {
+    std::this_thread::sleep_for(timeout);
+    now = std::chrono::steady_clock::now();
+  }
+
+  std::vector<Impl::Async::Call> expired;
+  for (auto it = async.calls.begin(); it != async.calls.end();) {
+    if (it->second.deadline > now) {
+      ++it;
+      continue;
+    }
+    expired.push_back(std::move(it->second));
+    it = async.calls.erase(it);
+  }
+  for (auto& call : expired) {
+    invoke([&]() { call.done(nullptr); });
+    ran = true;
+  }
+  if (error)
+    std::rethrow_exception(error);
+  return ran;
+}
+
+int
+MessageBroker::fd() const
+{
+  return m_impl->async.conn ? m_impl->async.conn->fd() : -1;
+}
+
+short
+MessageBroker::events() const
+{
+  return POLLIN;
+}
+
+std::optional<std::chrono::steady_clock::time_point>
+MessageBroker::deadline() const
+{
+  const auto& async = m_impl->async;
+  auto now = std::chrono::steady_clock::now();
+  if (!async.completions.empty() ||
+      (async.conn && async.conn->hasPending()))
+    return now;
+
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+  for (const auto& [id, call] : async.calls) {
+    deadline = std::min(deadline.value_or(call.deadline), call.deadline);
+  }
+  if (!async.timers.empty()) {
+    auto due = async.timers.begin()->first;
+    deadline = std::min(deadline.value_or(due), due);
+  }
+  if (async.conn && async.conn->heartbeat() > 0) {
+    // rabbitmq-c sends heartbeats while it waits for frames
+    auto heartbeat = now + std::chrono::seconds(async.conn->heartbeat()) / 2;
+    deadline = std::min(deadline.value_or(heartbeat), heartbeat);
+  }
+  return deadline;
+}
+
+bool
+MessageBroker::process()
+{
+  // one read of the socket, then what it left buffered: polling the socket
+  // again is left to the event loop, and the rounds are bounded so that a
+  // busy connection does not starve it
+  const auto& async = m_impl->async;
+  auto pending = [&async]() {
+    return !async.completions.empty() ||
+           (async.conn && async.conn->hasPending());
+  };
+  bool ran = runOnce(std::chrono::milliseconds(0));
+  for (int i = 0; i < 64 && pending(); i++) {
+    ran |= runOnce(std::chrono::milliseconds(0));
+  }
+  return ran;
+}
+
+namespace {
+
+struct BrokerSource
+{
+  GSource source;
+  MessageBroker* broker;
+  gpointer tag;
+  /// the socket polled through tag
+  int fd;
+};
+
+gboolean
+broker_source_prepare(GSource* source, gint* timeout)
+{
+  auto self = (BrokerSource*)source;
+  // the connection is opened by the first asynchronous call, and replaced
+  // once the server closed its channel
+  int fd = self->broker->fd();
+  if (fd != self->fd) {
+    if (self->tag)
+      g_source_remove_unix_fd(source, self->tag);
+    self->tag = fd >= 0 ? g_source_add_unix_fd(
+                            source, fd, GIOCondition(self->broker->events()))
+                        : nullptr;
+    self->fd = fd;
+  }
+
+  auto deadline = self->broker->deadline();
+  if (!deadline.has_value()) {
+    *timeout = -1;
+    return FALSE;
+  }
+  auto left = std::chrono::ceil<std::chrono::milliseconds>(
+    deadline.value() - std::chrono::steady_clock::now());
+  *timeout = std::max<gint>(left.count(), 0);
+  return *timeout == 0;
+}
+
+gboolean
+broker_source_check(GSource* source)
+{
+  auto self = (BrokerSource*)source;
+  if (self->tag && g_source_query_unix_fd(source, self->tag) != 0)
+    return TRUE;
+  auto deadline = self->broker->deadline();
+  return deadline.has_value() &&
+         deadline.value() <= std::chrono::steady_clock::now();
+}
+
+gboolean
+broker_source_dispatch(GSource* source, GSourceFunc, gpointer)
+{
+  ((BrokerSource*)source)->broker->process();
+  return G_SOURCE_CONTINUE;
+}
+
+GSourceFuncs broker_source_funcs = { broker_source_prepare,
+                                     broker_source_check,
+                                     broker_source_dispatch,
+                                     nullptr,
+                                     nullptr,
+                                     nullptr };
+
+} // namespace
+
+GSource*
+MessageBroker::createSource()
+{
+  GSource* source = g_source_new(&broker_source_funcs, sizeof(BrokerSource));
+  auto self = (BrokerSource*)source;
+  self->broker = this;
+  self->tag = nullptr;
+  self->fd = -1;
+  g_source_set_name(source, "MessageBroker");
+  return source;
 }
 
 void
-MessageBroker::subscribe(const Configuration& cfg,
-                         std::function<void(const Message&)> callback)
+MessageBroker::monitor(const std::vector<std::string>& queue_names,
+                       std::chrono::milliseconds interval)
 {
-  std::thread worker([this, cfg, callback]() {
-    struct timeval tv = { 1, 0 };
-    auto conn = AmqpConnection::createInstance();
-    conn->open(m_impl->host, m_impl->port);
-    conn->login(
-      m_impl->vhost, m_impl->username, m_impl->password, m_impl->frame_max);
+  std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+  m_impl->monitor_interval = interval;
+  sample(queue_names);
+}
 
-    auto channel = AmqpChannel::createInstance(conn);
-    auto [exchange, queue] = setup(cfg, channel);
-    channel->basicConsume(queue);
+void
+MessageBroker::sample(const std::vector<std::string>& queue_names)
+{
+  m_impl->monitored.insert(queue_names.begin(), queue_names.end());
+  if (m_impl->monitor_thread.joinable() || m_impl->close)
+    return;
+
+  m_impl->monitor_thread = std::thread([this]() {
+    AmqpConnection::Ptr conn;
+    AmqpChannel::Ptr channel;
+    std::unique_lock<std::mutex> lock(m_impl->monitor_mutex);
 
     while (!m_impl->close) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      auto envelope = channel->basicConsumeMessage(&tv);
-      if (!envelope) {
-        continue;
+      std::set<std::string> queues = m_impl->monitored;
+      for (const auto& group : m_impl->subscriptions) {
+        if (!group->queue.empty())
+          queues.insert(group->queue);
       }
-      callback(envelope->message());
+      lock.unlock();
+      // consumers which scale() retired since the last round
+      reap();
+
+      std::map<std::string, QueueStats> samples;
+      try {
+        if (!conn) {
+          conn = connect();
+        }
+        for (const auto& queue : queues) {
+          if (!channel)
+            channel = AmqpChannel::createInstance(conn);
+          try {
+            samples[queue] = channel->queueStats(queue);
+          } catch (const std::runtime_error&) {
+            // the queue is missing (yet): the broker closed the channel
+            if (channel->isOpen())
+              throw;
+            channel.reset();
+          }
+        }
+      } catch (const std::runtime_error&) {
+        // connection lost, reconnect on the next round
+        channel.reset();
+        conn.reset();
+      }
+
+      lock.lock();
+      m_impl->queue_stats.swap(samples);
+      scale();
+      m_impl->monitor_cv.notify_all();
+      m_impl->monitor_cv.wait_for(
+        lock, m_impl->monitor_interval, [this]() { return !!m_impl->close; });
     }
   });
+}
 
-  m_impl->threads.push_back(std::move(worker));
+MessageBroker::Metrics
+MessageBroker::metrics() const
+{
+  std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+  Metrics metrics;
+  metrics.queues = m_impl->queue_stats;
+  for (const auto& group : m_impl->subscriptions) {
+    Metrics::Subscription s;
+    s.queue = group->queue;
+    s.delivered = group->delivered;
+    s.handler_time = std::chrono::nanoseconds(group->handler_ns);
+    s.handler_p90 = group->handler_p90;
+    s.consumers = group->consumers;
+    s.prefetch = group->prefetch;
+    s.rtt = std::chrono::nanoseconds(group->rtt_ns);
+    s.duplicates = group->duplicates;
+    s.expired = group->expired;
+    s.filtered = group->filtered;
+    s.failed = group->failed;
+    s.retried = group->retried;
+    s.dead_lettered = group->dead_lettered;
+    s.dropped = group->dropped;
+    s.retry_errors = group->retry_errors;
+    s.resubscribed = group->resubscribed;
+    s.connection_errors = group->connection_errors;
+    auto it = m_impl->queue_stats.find(group->queue);
+    if (it != m_impl->queue_stats.end())
+      s.lag = it->second.message_count;
+    metrics.subscriptions.push_back(s);
+  }
+
+  for (std::size_t i = 0; i < 2; i++) {
+    std::lock_guard<std::mutex> lane_lock(m_impl->lanes[i].mutex);
+    (i ? metrics.priority_publisher : metrics.publisher) =
+      m_impl->lanes[i].publisher;
+  }
+  metrics.returned = m_impl->returned;
+  if (auto stage = m_impl->hot_published.load())
+    metrics.published_keys = stage->metrics();
+  if (auto stage = m_impl->hot_consumed.load())
+    metrics.consumed_keys = stage->metrics();
+  metrics.frame_max = m_impl->frame_max;
+  if (m_impl->adapt) {
+    std::array<std::uint64_t, 32> sizes;
+    for (std::size_t i = 0; i < sizes.size(); i++) {
+      sizes[i] = m_impl->sizes[i];
+    }
+    std::tie(metrics.frame_max, metrics.socket_buffer) =
+      fit_frames(sizes, m_impl->header_size, m_impl->max_frame);
+  }
+
+  std::lock_guard<std::mutex> flow_lock(m_impl->flow_mutex);
+  metrics.blocked = m_impl->blocked > 0;
+  metrics.blocked_reason = m_impl->blocked_reason;
+  metrics.blocked_time = m_impl->blocked_time;
+  if (metrics.blocked)
+    metrics.blocked_time +=
+      std::chrono::steady_clock::now() - m_impl->blocked_since;
+  return metrics;
 }
 
 void
-MessageBroker::subscribe(
-  const Configuration& cfg,
-  std::function<bool(const Request&, Response&)> callback)
+MessageBroker::trackHotKeys(std::size_t top, std::chrono::milliseconds window)
 {
-  std::thread worker([this, cfg, callback]() {
-    struct timeval tv = { 1, 0 };
-    auto conn = AmqpConnection::createInstance();
-    conn->open(m_impl->host, m_impl->port);
-    conn->login(
-      m_impl->vhost, m_impl->username, m_impl->password, m_impl->frame_max);
+  std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+  auto published = std::make_unique<HotKeyStage>(top, window);
+  auto consumed = std::make_unique<HotKeyStage>(top, window);
+  m_impl->hot_published = published.get();
+  m_impl->hot_consumed = consumed.get();
+  m_impl->hot_stages.push_back(std::move(published));
+  m_impl->hot_stages.push_back(std::move(consumed));
+}
 
-    auto channel = AmqpChannel::createInstance(conn);
-    auto [exchange, queue] = setup(cfg, channel);
-    channel->basicConsume(queue);
+void
+MessageBroker::record(bool consumed,
+                      const std::string& routing_key,
+                      const Message& message)
+{
+  if (m_impl->adapt.load(std::memory_order_relaxed)) {
+    std::size_t size = message.body().size();
+    std::size_t bucket = 0;
+    while (bucket + 1 < m_impl->sizes.size() && size >> bucket)
+      bucket++;
+    m_impl->sizes[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    // as written on the wire, with the property flags
+    std::uint64_t header = basic_properties_size(message.properties());
+    auto seen = m_impl->header_size.load(std::memory_order_relaxed);
+    while (header > seen && !m_impl->header_size.compare_exchange_weak(
+                              seen, header, std::memory_order_relaxed)) {
+    }
+  }
 
-    while (!m_impl->close) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      auto envelope = channel->basicConsumeMessage(&tv);
-      if (!envelope) {
-        continue;
-      }
+  auto stage = (consumed ? m_impl->hot_consumed : m_impl->hot_published)
+                 .load(std::memory_order_acquire);
+  if (!stage)
+    return;
+  stage->routing_keys.add(routing_key);
+  const auto& type = message.properties().type;
+  if (type.has_value())
+    stage->types.add(type.value());
+}
+
+void
+MessageBroker::adaptFrames(const std::string& profile, int max_frame)
+{
+  std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+  m_impl->profile = profile;
+  m_impl->max_frame = max_frame;
+  GKeyFile* file = g_key_file_new();
+  // a missing profile is created by close()
+  if (!profile.empty() &&
+      g_key_file_load_from_file(file, profile.c_str(), G_KEY_FILE_NONE, NULL)) {
+    gchar** keys = g_key_file_get_keys(file, "sizes", NULL, NULL);
+    for (gchar** key = keys; key && *key; ++key) {
+      // keys are the bucket bounds, powers of two
+      std::uint64_t bound = g_ascii_strtoull(*key, NULL, 10);
+      std::size_t bucket = 0;
+      while (bucket + 1 < m_impl->sizes.size() && (1ull << bucket) < bound)
+        bucket++;
+      m_impl->sizes[bucket] += g_key_file_get_uint64(file, "sizes", *key, NULL);
+    }
+    g_strfreev(keys);
+    m_impl->header_size =
+      g_key_file_get_uint64(file, "headers", "largest", NULL);
+  }
+  g_key_file_free(file);
+  m_impl->adapt = true;
+}
+
+AmqpConnection::Ptr
+MessageBroker::connect()
+{
+  int frame_max = m_impl->frame_max;
+  int buffer = 0;
+  if (m_impl->adapt) {
+    std::array<std::uint64_t, 32> sizes;
+    for (std::size_t i = 0; i < sizes.size(); i++) {
+      sizes[i] = m_impl->sizes[i].load(std::memory_order_relaxed);
+    }
+    std::tie(frame_max, buffer) =
+      fit_frames(sizes, m_impl->header_size, m_impl->max_frame);
+  }
+
+  auto conn = AmqpConnection::createInstance();
+  conn->open(m_impl->host, m_impl->port);
+  if (buffer)
+    conn->setSocketBuffers(buffer, buffer);
+  conn->login(m_impl->vhost, m_impl->username, m_impl->password, frame_max);
+  // the broker lowered it to its limit, which later connections keep to
+  if (m_impl->adapt && conn->frameMax() < frame_max)
+    m_impl->max_frame = conn->frameMax();
+  return conn;
+}
+
+AmqpConnection::Ptr
+MessageBroker::connectPublisher(std::chrono::milliseconds max_wait)
+{
+  // the broker may block it before connection.blocked is read, replies and
+  // writes are bounded then instead of hanging
+  auto conn = connect();
+  watch(conn);
+  conn->setTimeout(max_wait.count() > 0 ? max_wait
+                                        : std::chrono::milliseconds(30000));
+  return conn;
+}
 
-      Request req;
-      req.body() = envelope->message().body();
-      req.properties() = envelope->message().properties();
-      Response res;
+void
+MessageBroker::onReturn(std::function<void(const AmqpReturn&)> callback)
+{
+  std::lock_guard<std::mutex> lock(m_impl->return_mutex);
+  m_impl->on_return = std::move(callback);
+}
 
-      auto ok = callback(req, res);
-      std::string reply_to(req.properties().reply_to.value());
-      std::string correlation_id(req.properties().correlation_id.value());
+void
+MessageBroker::handleReturn(const AmqpReturn& message)
+{
+  m_impl->returned++;
+  std::function<void(const AmqpReturn&)> callback;
+  {
+    std::lock_guard<std::mutex> lock(m_impl->return_mutex);
+    callback = m_impl->on_return;
+  }
+  if (!callback)
+    return;
+  // the message was published, a failing callback does not fail the
+  // publisher it is called from
+  try {
+    callback(message);
+  } catch (const std::exception&) {
+  }
+}
 
-      if (!res.properties().content_type.has_value())
-        res.properties().content_type = "application/json";
-      if (!res.properties().delivery_mode.has_value())
-        res.properties().delivery_mode = 2u;
-      if (!res.properties().correlation_id.has_value())
-        res.properties().correlation_id = correlation_id;
-      if (!res.properties().type.has_value())
-        res.properties().type = ok ? MESSAGE_TYPE_RESPONSE : MESSAGE_TYPE_ERROR;
+bool
+MessageBroker::admit(const Configuration& cfg, bool spool)
+{
+  std::unique_lock<std::mutex> lock(m_impl->flow_mutex);
+  if (!m_impl->blocked)
+    return false;
+  if (cfg.blocked.action == BLOCKED_FAIL) {
+    throw std::runtime_error("Publishing: connection blocked by the broker: " +
+                             m_impl->blocked_reason);
+  }
+  if (cfg.blocked.action == BLOCKED_SPOOL && spool)
+    return true;
+
+  auto unblocked = [this]() { return !m_impl->blocked || m_impl->close; };
+  if (cfg.blocked.max_wait.count() == 0) {
+    m_impl->flow_cv.wait(lock, unblocked);
+  } else if (!m_impl->flow_cv.wait_for(
+               lock, cfg.blocked.max_wait, unblocked)) {
+    throw std::runtime_error(
+      "Publishing: connection still blocked by the broker: " +
+      m_impl->blocked_reason);
+  }
+  return false;
+}
 
-      channel->basicPublish("", reply_to, res);
+void
+MessageBroker::watch(AmqpConnection::Ptr conn)
+{
+  conn->setBlockedHandler([this](bool blocked, const std::string& reason) {
+    std::lock_guard<std::mutex> lock(m_impl->flow_mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (blocked) {
+      if (m_impl->blocked++ == 0)
+        m_impl->blocked_since = now;
+      m_impl->blocked_reason = reason;
+    } else if (m_impl->blocked > 0 && --m_impl->blocked == 0) {
+      m_impl->blocked_time += now - m_impl->blocked_since;
+      m_impl->flow_cv.notify_all();
     }
   });
+}
 
-  m_impl->threads.push_back(std::move(worker));
+void
+MessageBroker::throttle(const Configuration& cfg)
+{
+  if (cfg.rate_limit)
+    cfg.rate_limit->acquire();
+
+  const auto& backpressure = cfg.backpressure;
+  if (backpressure.queue.empty() || backpressure.max_depth == 0)
+    return;
+
+  std::unique_lock<std::mutex> lock(m_impl->monitor_mutex);
+  // depth is known from the sampler only, started on first use
+  sample({ backpressure.queue });
+  auto exceeded = [this, &backpressure]() {
+    auto it = m_impl->queue_stats.find(backpressure.queue);
+    return it != m_impl->queue_stats.end() &&
+           it->second.message_count > backpressure.max_depth;
+  };
+  if (!exceeded())
+    return;
+
+  if (backpressure.hook) {
+    QueueStats stats = m_impl->queue_stats[backpressure.queue];
+    lock.unlock();
+    backpressure.hook(stats);
+    return;
+  }
+  m_impl->monitor_cv.wait_for(lock, backpressure.max_wait, [&]() {
+    return !exceeded() || m_impl->close;
+  });
 }
 
 void
 MessageBroker::close()
 {
-  m_impl->close = true;
+  {
+    std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+    m_impl->close = true;
+    m_impl->monitor_cv.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_impl->flow_mutex);
+    m_impl->flow_cv.notify_all();
+  }
+  if (m_impl->monitor_thread.joinable())
+    m_impl->monitor_thread.join();
+  for (auto& lane : m_impl->lanes) {
+    // the batching thread writes what is pending, then stops
+    {
+      std::lock_guard<std::mutex> lock(lane.mutex);
+      lane.cv.notify_all();
+    }
+    if (lane.thread.joinable())
+      lane.thread.join();
+  }
+  // no consumer is spawned anymore once the monitor thread is gone
+  std::vector<std::thread> threads;
+  {
+    std::lock_guard<std::mutex> lock(m_impl->monitor_mutex);
+    threads.swap(m_impl->threads);
+    m_impl->retired.clear();
+  }
+  for (auto it = threads.begin(); it != threads.end(); it++) {
+    if (!it->joinable())
+      continue;
+    if (it->get_id() == std::this_thread::get_id())
+      it->detach();
+    else
+      it->join();
+  }
+
+  if (m_impl->adapt && !m_impl->profile.empty()) {
+    GKeyFile* file = g_key_file_new();
+    for (std::size_t i = 0; i < m_impl->sizes.size(); i++) {
+      if (m_impl->sizes[i]) {
+        g_key_file_set_uint64(
+          file, "sizes", std::to_string(1ull << i).c_str(), m_impl->sizes[i]);
+      }
+    }
+    g_key_file_set_uint64(file, "headers", "largest", m_impl->header_size);
+    // not thrown, close() is called by the destructor; the profile is only
+    // a hint for the next start
+    g_key_file_save_to_file(file, m_impl->profile.c_str(), NULL);
+    g_key_file_free(file);
+  }
 }
 
-std::tuple<std::string, std::string>
-MessageBroker::setup(const Configuration& cfg, AmqpChannel::Ptr channel)
+void
+MessageBroker::declare(const std::vector<Configuration>& configurations)
 {
-  std::string exchange_name, queue_name;
+  auto conn = connect();
 
-  if (cfg.exchange.name == "amq") {
-    exchange_name = "amq." + cfg.exchange.type;
+  auto channel = AmqpChannel::createInstance(conn);
+  declare(configurations, channel);
+}
+
+void
+MessageBroker::declare(const std::vector<Configuration>& configurations,
+                       AmqpChannel::Ptr channel)
+{
+  std::vector<Declaration> steps;
+  for (const auto& cfg : configurations) {
+    plan_declarations(
+      cfg, std::make_shared<std::pair<std::string, std::string>>(), steps);
+  }
+  run_declarations(*channel, steps);
+}
+
+MessageBroker::Topology
+MessageBroker::Topology::load(const std::string& path)
+{
+  GKeyFile* file = g_key_file_new();
+  GError* error = NULL;
+  if (!g_key_file_load_from_file(file, path.c_str(), G_KEY_FILE_NONE, &error)) {
+    std::string text = error->message;
+    g_error_free(error);
+    g_key_file_free(file);
+    die("Loading topology %s: %s", path.c_str(), text.c_str());
   }
 
-  if (cfg.exchange.declare) {
-    if (cfg.exchange.arguments.has_value()) {
-      channel->exchangeDeclare(cfg.exchange.name,
-                               cfg.exchange.type,
-                               cfg.exchange.passive,
-                               cfg.exchange.durable,
-                               cfg.exchange.auto_delete,
-                               cfg.exchange.internal,
-                               cfg.exchange.arguments.value());
+  auto value = [file](const gchar* group, const gchar* key) {
+    gchar* v = g_key_file_get_value(file, group, key, NULL);
+    std::string result(v ? v : "");
+    g_free(v);
+    return result;
+  };
+  auto flag = [&value](const gchar* group, const gchar* key) {
+    return value(group, key) == "true";
+  };
+  auto arguments = [file, &value](const gchar* group) {
+    std::optional<Table> table;
+    gchar** keys = g_key_file_get_keys(file, group, NULL, NULL);
+    for (gchar** key = keys; key && *key; ++key) {
+      if (g_str_has_prefix(*key, "argument.")) {
+        if (!table.has_value())
+          table = Table();
+        table->insert(TableEntry(*key + strlen("argument."),
+                                 parse_table_value(value(group, *key))));
+      }
+    }
+    g_strfreev(keys);
+    return table;
+  };
+
+  Topology topology;
+  gchar** groups = g_key_file_get_groups(file, NULL);
+  for (gchar** group = groups; group && *group; ++group) {
+    std::string header(*group);
+    auto space = header.find(' ');
+    std::string kind = header.substr(0, space);
+    std::string name =
+      space == std::string::npos ? "" : header.substr(space + 1);
+
+    if (kind == "exchange") {
+      Configuration::Exchange e;
+      e.name = name;
+      e.type = value(*group, "type");
+      if (e.type.empty())
+        e.type = AmqpChannel::EXCHANGE_TYPE_DIRECT;
+      e.passive = flag(*group, "passive");
+      e.durable = flag(*group, "durable");
+      e.auto_delete = flag(*group, "auto_delete");
+      e.internal = flag(*group, "internal");
+      e.declare = true;
+      e.arguments = arguments(*group);
+      topology.exchanges.push_back(e);
+    } else if (kind == "queue") {
+      Configuration::Queue q;
+      q.name = name;
+      q.passive = flag(*group, "passive");
+      q.durable = flag(*group, "durable");
+      q.auto_delete = flag(*group, "auto_delete");
+      q.exclusive = flag(*group, "exclusive");
+      q.declare = true;
+      q.arguments = arguments(*group);
+      topology.queues.push_back(q);
+    } else if (kind == "binding") {
+      Binding b;
+      b.source = value(*group, "source");
+      b.destination = value(*group, "destination");
+      b.exchange = value(*group, "destination_type") == "exchange";
+      b.routing_key = value(*group, "routing_key");
+      b.arguments = arguments(*group);
+      topology.bindings.push_back(b);
     } else {
-      channel->exchangeDeclare(cfg.exchange.name,
-                               cfg.exchange.type,
-                               cfg.exchange.passive,
-                               cfg.exchange.durable,
-                               cfg.exchange.auto_delete,
-                               cfg.exchange.internal);
+      g_strfreev(groups);
+      g_key_file_free(file);
+      die("Loading topology %s: unknown group [%s]", path.c_str(), *group);
     }
-    exchange_name = cfg.exchange.name;
   }
+  g_strfreev(groups);
+  g_key_file_free(file);
 
-  if (cfg.queue.declare) {
-    if (cfg.queue.arguments.has_value()) {
-      queue_name = channel->queueDeclare(cfg.queue.name,
-                                         cfg.queue.passive,
-                                         cfg.queue.durable,
-                                         cfg.queue.exclusive,
-                                         cfg.queue.auto_delete,
-                                         cfg.queue.arguments.value());
-    } else {
-      queue_name = channel->queueDeclare(cfg.queue.name,
-                                         cfg.queue.passive,
-                                         cfg.queue.durable,
-                                         cfg.queue.exclusive,
-                                         cfg.queue.auto_delete);
+  return topology;
+}
+
+void
+MessageBroker::declare(const Topology& topology)
+{
+  std::lock_guard<std::mutex> lock(m_impl->topology_mutex);
+  std::vector<Declaration> steps;
+  std::vector<std::string> applied;
+
+  auto changed = [this, &applied](std::string fingerprint, bool cacheable) {
+    if (m_impl->topology_fingerprints.count(fingerprint))
+      return false;
+    if (cacheable)
+      applied.push_back(std::move(fingerprint));
+    return true;
+  };
+
+  for (const auto& e : topology.exchanges) {
+    std::string fingerprint =
+      "exchange/" + std::to_string(e.name.size()) + ":" + e.name + "/" +
+      e.type + "/" + std::to_string(e.passive) + std::to_string(e.durable) +
+      std::to_string(e.auto_delete) + std::to_string(e.internal) + "/" +
+      table_fingerprint(e.arguments.value_or(Table()));
+    if (changed(fingerprint, true)) {
+      Configuration cfg;
+      cfg.exchange = e;
+      cfg.exchange.declare = true;
+      plan_declarations(
+        cfg, std::make_shared<std::pair<std::string, std::string>>(), steps);
     }
   }
 
-  if (cfg.queue.bind) {
-    std::string binding_key =
-      cfg.exchange.type == AmqpChannel::EXCHANGE_TYPE_TOPIC
-        ? cfg.routing_pattern
-        : cfg.routing_key;
-    channel->queueBind(queue_name, exchange_name, binding_key);
+  for (const auto& q : topology.queues) {
+    if (q.name.empty()) {
+      die("Applying topology: queues must be named");
+    }
+    std::string fingerprint =
+      "queue/" + std::to_string(q.name.size()) + ":" + q.name + "/" +
+      std::to_string(q.passive) + std::to_string(q.durable) +
+      std::to_string(q.auto_delete) + std::to_string(q.exclusive) + "/" +
+      table_fingerprint(q.arguments.value_or(Table()));
+    if (changed(fingerprint, !q.exclusive)) {
+      Configuration cfg;
+      cfg.queue = q;
+      cfg.queue.declare = true;
+      cfg.queue.bind = false;
+      plan_declarations(
+        cfg, std::make_shared<std::pair<std::string, std::string>>(), steps);
+    }
+  }
+
+  for (const auto& b : topology.bindings) {
+    if (changed(binding_fingerprint(b), true)) {
+      steps.push_back([b](AmqpChannel& channel, bool nowait) {
+        if (b.exchange && nowait)
+          channel.exchangeBindNoWait(b.destination,
+                                     b.source,
+                                     b.routing_key,
+                                     b.arguments.value_or(Table()));
+        else if (b.exchange)
+          channel.exchangeBind(b.destination,
+                               b.source,
+                               b.routing_key,
+                               b.arguments.value_or(Table()));
+        else if (nowait)
+          channel.queueBindNoWait(b.destination,
+                                  b.source,
+                                  b.routing_key,
+                                  b.arguments.value_or(Table()));
+        else
+          channel.queueBind(b.destination,
+                            b.source,
+                            b.routing_key,
+                            b.arguments.value_or(Table()));
+      });
+    }
   }
 
-  return std::make_tuple(exchange_name, queue_name);
+  if (steps.empty())
+    return;
+
+  auto conn = connect();
+
+  auto channel = AmqpChannel::createInstance(conn);
+  run_declarations(*channel, steps);
+
+  m_impl->topology_fingerprints.insert(applied.begin(), applied.end());
+}
+
+std::tuple<std::string, std::string>
+MessageBroker::setup(const Configuration& cfg, AmqpChannel::Ptr channel)
+{
+  auto names = std::make_shared<std::pair<std::string, std::string>>();
+  std::vector<Declaration> steps;
+  plan_declarations(cfg, names, steps);
+  run_declarations(*channel, steps);
+
+  return std::make_tuple(names->first, names->second);
 }
 
 } // end namespace gs
@@ -1,14 +1,19 @@
 #ifndef MESSAGE_BROKER_H
 #define MESSAGE_BROKER_H
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <map>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+typedef struct _GSource GSource;
+
 namespace gs {
 namespace amqp {
 
@@ -49,6 +54,8 @@ public:
 
   AmqpTableValue(const AmqpTableValue& l);
 
+  AmqpTableValue& operator=(const AmqpTableValue& l);
+
   AmqpTableValue(bool value);
 
   AmqpTableValue(std::uint8_t value);
@@ -75,6 +82,10 @@ public:
 
   AmqpTableValue(const std::string& value);
 
+  AmqpTableValue(const std::vector<AmqpTableValue>& value);
+
+  AmqpTableValue(const AmqpTable& value);
+
   virtual ~AmqpTableValue();
 
   ValueType getType() const;
@@ -113,11 +124,21 @@ private:
   std::unique_ptr<Impl> m_impl;
 };
 
+/** counters of a queue, from queue.declare-ok */
+struct AmqpQueueStats
+{
+  std::string name;
+  std::uint32_t message_count = 0;  ///< messages ready for delivery
+  std::uint32_t consumer_count = 0; ///< active consumers
+  std::chrono::steady_clock::time_point sampled; ///< when this was received
+};
+
 /** basic class properties */
 struct AmqpProperties
 {
   std::optional<std::string> content_type;
   std::optional<std::string> content_encoding;
+  std::optional<AmqpTable> headers;
   std::optional<uint8_t> delivery_mode;
   std::optional<uint8_t> priority;
   std::optional<std::string> correlation_id;
@@ -131,6 +152,18 @@ struct AmqpProperties
   std::optional<std::string> cluster_id;
 };
 
+/** a message body held outside of the message, see AmqpBlobStore */
+class AmqpBlob
+{
+public:
+  using Ptr = std::shared_ptr<const AmqpBlob>;
+
+  virtual ~AmqpBlob();
+
+  virtual const char* data() const = 0;
+  virtual std::size_t size() const = 0;
+};
+
 class AmqpMessage
 {
 public:
@@ -142,9 +175,34 @@ public:
 
   /**
    * Gets the message body as a std::string&
+   *
+   * A body set with \ref setBodyLoader is loaded and copied on first access.
+   * Reading it through a const message is safe from several threads.
+   */
+  const std::string& body() const
+  {
+    return m_deferred ? deferredBody() : m_body;
+  }
+  std::string& body()
+  {
+    if (m_deferred)
+      detachBody();
+    return m_body;
+  }
+
+  /**
+   * Gets the message body without copying it
+   *
+   * A body set with \ref setBodyLoader is loaded but not copied; the view is
+   * valid as long as the message lives.
+   */
+  std::string_view bodyView() const;
+
+  /**
+   * Defers the body to @p loader, called the first time the body is read.
+   * Copies of the message share the loaded body.
    */
-  const std::string& body() const noexcept { return m_body; }
-  std::string& body() noexcept { return m_body; }
+  void setBodyLoader(std::function<AmqpBlob::Ptr()> loader);
 
   /**
    * Gets the message properties as a AmqpProperties&
@@ -155,8 +213,78 @@ public:
   static Ptr createInstance() { return std::make_shared<AmqpMessage>(); }
 
 private:
+  struct Deferred;
+
+  const std::string& deferredBody() const;
+  void detachBody();
+
   std::string m_body;
   AmqpProperties m_properties;
+  /// a body set with setBodyLoader(), shared by copies
+  std::shared_ptr<Deferred> m_deferred;
+};
+
+/**
+ * Storage for message bodies sent by reference ("claim check")
+ *
+ * A body above a size threshold is put in the store and the message only
+ * carries its reference in the \ref HEADER header, which keeps large payloads
+ * out of the broker's memory and from delaying other messages on the
+ * connection.
+ */
+class AmqpBlobStore
+{
+public:
+  using Ptr = std::shared_ptr<AmqpBlobStore>;
+  using WPtr = std::weak_ptr<AmqpBlobStore>;
+
+  ///< `"x-claim-check"` header carrying the reference of a stored body
+  static const char* HEADER;
+
+  virtual ~AmqpBlobStore();
+
+  /**
+   * Stores a body
+   * @returns the reference to put in the message
+   */
+  virtual std::string put(const std::string& body) = 0;
+
+  /**
+   * Gets a stored body
+   * @param reference The reference returned by \ref put
+   */
+  virtual AmqpBlob::Ptr get(const std::string& reference) = 0;
+
+  /**
+   * Deletes a stored body, e.g. once its message has been processed; the
+   * store does not expire bodies by itself. Removing a missing body is not
+   * an error.
+   */
+  virtual void remove(const std::string& reference) = 0;
+};
+
+/**
+ * A blob store keeping each body in a file of a directory shared by
+ * publishers and consumers, such as a network file system or, on a single
+ * host, a directory under `/dev/shm`. Bodies are read through `mmap`.
+ */
+class AmqpDirectoryBlobStore : public AmqpBlobStore
+{
+public:
+  AmqpDirectoryBlobStore(const std::string& path);
+  virtual ~AmqpDirectoryBlobStore();
+
+  std::string put(const std::string& body) override;
+  AmqpBlob::Ptr get(const std::string& reference) override;
+  void remove(const std::string& reference) override;
+
+  static Ptr createInstance(const std::string& path)
+  {
+    return std::make_shared<AmqpDirectoryBlobStore>(path);
+  }
+
+private:
+  std::string m_path;
 };
 
 class AmqpEnvelope
@@ -207,6 +335,35 @@ private:
   const std::string m_routingKey;
 };
 
+/** a delivery before its body is read, see AmqpChannel::basicConsumeMessage */
+struct AmqpDeliveryHead
+{
+  std::string_view exchange;
+  std::string_view routing_key;
+  bool redelivered;
+  AmqpProperties properties;
+};
+
+/** a message with its destination, see AmqpChannel::basicPublish() */
+struct AmqpPublication
+{
+  std::string exchange;
+  std::string routing_key;
+  AmqpMessage message;
+  bool mandatory = false;
+  bool immediate = false;
+};
+
+/** a message the broker could not route, see AmqpChannel::setReturnHandler */
+struct AmqpReturn
+{
+  std::uint16_t reply_code;
+  std::string reply_text;
+  std::string exchange;
+  std::string routing_key;
+  AmqpMessage message;
+};
+
 class AmqpConnection
 {
 public:
@@ -222,6 +379,45 @@ public:
              const std::string& password,
              int frame_max) const;
 
+  /// The socket, to poll for readability in an external event loop.
+  int fd() const;
+
+  /// Whether frames were read from the socket already and wait to be
+  /// consumed; the socket may not be readable then.
+  bool hasPending() const;
+
+  /// Heartbeat interval negotiated at login in seconds, 0 when disabled.
+  int heartbeat() const;
+
+  /// frame_max negotiated at login: the one asked for, or the broker's
+  /// limit when lower.
+  int frameMax() const;
+
+  /// Enlarges the kernel buffers of the socket, e.g. to hold a large message
+  /// whole. Sizes below the current ones are ignored: setting a size stops
+  /// the kernel from tuning it automatically.
+  void setSocketBuffers(int send, int receive);
+
+  /// Bounds the wait for the reply of a synchronous method, closing ones
+  /// included, and for the socket to take the frames written directly (see
+  /// AmqpPreparedPublish), which otherwise lasts as long as the broker does
+  /// not answer or read, e.g. while it blocks the connection. A method
+  /// timing out throws, or is given up silently when closing.
+  void setTimeout(std::chrono::milliseconds timeout);
+
+  /// Whether the broker blocked the connection, as it does during a memory
+  /// or disk alarm: it stops reading from the socket until `connection.
+  /// unblocked`, so publishing would hang. The `connection.blocked`
+  /// capability is advertised at login, and the notifications are read by
+  /// the channels of the connection along with their other frames.
+  bool blocked() const;
+
+  /// Sets the handler called when the connection is blocked, with the reason
+  /// given by the broker, and when it is unblocked; it is also called as
+  /// unblocked when a blocked connection is destroyed.
+  void setBlockedHandler(
+    std::function<void(bool blocked, const std::string& reason)> handler);
+
   static Ptr createInstance() { return std::make_shared<AmqpConnection>(); }
 
 private:
@@ -244,6 +440,9 @@ public:
   ///< `"topic"` string constant
   static const char* EXCHANGE_TYPE_TOPIC;
 
+  ///< `"headers"` string constant
+  static const char* EXCHANGE_TYPE_HEADERS;
+
   using Ptr = std::shared_ptr<AmqpChannel>;
   using WPtr = std::weak_ptr<AmqpChannel>;
 
@@ -310,6 +509,19 @@ public:
                     const std::string& source,
                     const std::string& routing_key);
 
+  /**
+   * Binds one exchange to another exchange using a given key and arguments
+   * @param destination the name of the exchange to route messages to
+   * @param source the name of the exchange to route messages from
+   * @param routing_key the routing key to use when binding
+   * @param arguments A table of binding arguments, e.g. `x-match` for a
+   * `headers` source exchange
+   */
+  void exchangeBind(const std::string& destination,
+                    const std::string& source,
+                    const std::string& routing_key,
+                    const AmqpTable& arguments);
+
   /**
    * Unbind an existing exchange-exchange binding
    * @see BindExchange
@@ -321,6 +533,28 @@ public:
                       const std::string& source,
                       const std::string& routing_key);
 
+  /**
+   * Unbind an existing exchange-exchange binding made with arguments
+   * @param destination the name of the exchange to route messages to
+   * @param source the name of the exchange to route messages from
+   * @param routing_key the routing key to use when binding
+   * @param arguments the arguments of the binding, which the broker matches
+   * on as well, e.g. `x-match` for a `headers` source exchange
+   */
+  void exchangeUnbind(const std::string& destination,
+                      const std::string& source,
+                      const std::string& routing_key,
+                      const AmqpTable& arguments);
+
+  /**
+   * Deletes an exchange
+   * @param exchange_name the name of the exchange to delete
+   * @param if_unused only delete the exchange if it has no bindings; the
+   * broker closes the channel otherwise
+   */
+  void exchangeDelete(const std::string& exchange_name,
+                      bool if_unused = false);
+
   /**
    * Declare a queue
    *conn
@@ -373,6 +607,22 @@ public:
                            bool auto_delete,
                            const AmqpTable& arguments);
 
+  /**
+   * Gets the counters of a queue
+   *
+   * Declares the queue passively, which never creates or modifies it, and
+   * returns the message and consumer counts of the reply. Throws if the queue
+   * does not exist; the broker closes the channel in that case.
+   * @param queue_name The name of the queue.
+   */
+  AmqpQueueStats queueStats(const std::string& queue_name);
+
+  /**
+   * @returns `false` once the broker has closed the channel after an error;
+   * a new channel must be created to go on.
+   */
+  bool isOpen() const;
+
   /**
    * Binds a queue to an exchange
    *
@@ -387,6 +637,21 @@ public:
                  const std::string& exchange_name,
                  const std::string& routing_key = "");
 
+  /**
+   * Binds a queue to an exchange
+   *
+   * Connects a queue to an exchange on the broker.
+   * @param queue_name The name of the queue to bind.
+   * @param exchange_name The name of the exchange to bind to.
+   * @param routing_key Defines the routing key of the binding.
+   * @param arguments A table of binding arguments, e.g. `x-match` and the
+   * header values to match for a `headers` exchange.
+   */
+  void queueBind(const std::string& queue_name,
+                 const std::string& exchange_name,
+                 const std::string& routing_key,
+                 const AmqpTable& arguments);
+
   /**
    * Unbinds a queue from an exchange
    *
@@ -400,6 +665,75 @@ public:
                    const std::string& exchange_name,
                    const std::string& routing_key = "");
 
+  /**
+   * Unbinds a queue from an exchange
+   *
+   * Disconnects a queue from an exchange.
+   * @param queue_name The name of the queue to unbind.
+   * @param exchange_name The name of the exchange to unbind.
+   * @param routing_key This must match the routing_key of the binding.
+   * @param arguments This must match the arguments of the binding, e.g. the
+   * `x-match` and header values of a `headers` exchange binding.
+   */
+  void queueUnbind(const std::string& queue_name,
+                   const std::string& exchange_name,
+                   const std::string& routing_key,
+                   const AmqpTable& arguments);
+
+  /**
+   * Declares an exchange without waiting for the broker's reply
+   *
+   * Same as \ref exchangeDeclare but sent with the `nowait` bit, so several
+   * declarations can be pipelined in a single round trip. The broker reports
+   * a failure by closing the channel; it surfaces as an exception from the
+   * next synchronous method on this channel.
+   * @see exchangeDeclare
+   */
+  void exchangeDeclareNoWait(const std::string& exchange_name,
+                             const std::string& exchange_type,
+                             bool passive,
+                             bool durable,
+                             bool auto_delete,
+                             bool internal,
+                             const AmqpTable& arguments = AmqpTable());
+
+  /**
+   * Declares a queue without waiting for the broker's reply
+   *
+   * Same as \ref queueDeclare but sent with the `nowait` bit. The queue name
+   * must not be empty since the broker-generated name is only known from the
+   * reply.
+   * @see exchangeDeclareNoWait
+   */
+  void queueDeclareNoWait(const std::string& queue_name,
+                          bool passive,
+                          bool durable,
+                          bool exclusive,
+                          bool auto_delete,
+                          const AmqpTable& arguments = AmqpTable());
+
+  /**
+   * Binds a queue to an exchange without waiting for the broker's reply
+   *
+   * Same as \ref queueBind but sent with the `nowait` bit.
+   * @see exchangeDeclareNoWait
+   */
+  void queueBindNoWait(const std::string& queue_name,
+                       const std::string& exchange_name,
+                       const std::string& routing_key = "",
+                       const AmqpTable& arguments = AmqpTable());
+
+  /**
+   * Binds one exchange to another without waiting for the broker's reply
+   *
+   * Same as \ref exchangeBind but sent with the `nowait` bit.
+   * @see exchangeDeclareNoWait
+   */
+  void exchangeBindNoWait(const std::string& destination,
+                          const std::string& source,
+                          const std::string& routing_key,
+                          const AmqpTable& arguments = AmqpTable());
+
   /**
    * Publishes a Basic message
    *
@@ -418,6 +752,18 @@ public:
                     bool mandatory = false,
                     bool immediate = false);
 
+  /**
+   * Publishes several Basic messages at once
+   *
+   * The frames of all messages are encoded into one buffer and written with
+   * a single system call, instead of several per message.
+   * @param publications The messages and their destinations.
+   * @note Like \ref AmqpPreparedPublish the frames are written straight to
+   * the connection's socket, which must be a plain TCP one; throws
+   * otherwise.
+   */
+  void basicPublish(const std::vector<AmqpPublication>& publications);
+
   /**
    * Starts consuming Basic messages on a queue
    *
@@ -457,6 +803,17 @@ public:
    */
   void basicCancel(const std::string& consumer_tag);
 
+  /**
+   * Whether the broker cancelled a consumer
+   *
+   * With the `consumer_cancel_notify` capability, advertised at login, the
+   * broker sends `basic.cancel` when a consumer's queue is deleted or fails
+   * over; nothing is delivered to the consumer after that. It is read along
+   * with the deliveries, see \ref basicConsumeMessage.
+   * @param consumer_tag The tag returned by \ref basicConsume.
+   */
+  bool consumerCancelled(const std::string& consumer_tag) const;
+
   /**
    * Modify consumer's message prefetch count
    *
@@ -485,6 +842,96 @@ public:
   void basicNack(uint64_t delivery_tag,
                  bool multiple = false,
                  bool requeue = false);
+  /**
+   * Puts the channel in transactional mode
+   *
+   * Publishes and acks are then only applied by \ref txCommit, all at once,
+   * or discarded by \ref txRollback.
+   */
+  void txSelect();
+
+  /**
+   * Commits the publishes and acks since the last commit or rollback
+   */
+  void txCommit();
+
+  /**
+   * Discards the publishes and acks since the last commit or rollback
+   */
+  void txRollback();
+
+  /**
+   * Puts the channel in publisher confirm mode
+   *
+   * The broker then acks every message published on the channel once it
+   * took responsibility for it, see \ref waitForConfirms.
+   */
+  void confirmSelect();
+
+  /**
+   * Waits until every message published since \ref confirmSelect is
+   * confirmed
+   *
+   * Each delivery tag is tracked until an ack or nack covers it, singly or
+   * through `multiple`, so confirms may arrive in any order.
+   *
+   * @param timeout Time to wait at most, `nullptr` to wait indefinitely.
+   * @returns `false` when a message was nacked since the last call, or on
+   * timeout
+   */
+  bool waitForConfirms(const struct timeval* timeout = nullptr);
+
+  /**
+   * Sets the handler of returned messages
+   *
+   * Messages published with `mandatory` which no queue accepts come back in
+   * `basic.return` frames, about a round trip after being published. They are
+   * passed to @p handler whenever the channel reads frames: while consuming,
+   * getting messages, waiting for replies or confirms, in \ref pollReturns,
+   * and when the channel is closed. Without a handler they are dropped.
+   */
+  void setReturnHandler(std::function<void(const AmqpReturn&)> handler);
+
+  /**
+   * Reads the returned messages which arrived
+   *
+   * For channels which only publish; consumers read returns as they go.
+   * @param timeout Time to wait for the next frame, `{0, 0}` to read only
+   * what arrived already.
+   * @returns The number of messages returned
+   */
+  std::size_t pollReturns(const struct timeval* timeout);
+
+  /**
+   * Gets a message from a queue without a consumer
+   *
+   * @param queue_name The queue to get the message from.
+   * @param no_ack The message is considered acknowledged once sent.
+   * @param message_count Set to the number of messages left in the queue.
+   * @returns The message, or `nullptr` when the queue is empty
+   */
+  AmqpEnvelope::Ptr basicGet(const std::string& queue_name,
+                             bool no_ack = false,
+                             std::uint32_t* message_count = nullptr);
+
+  /**
+   * Gets several messages from a queue without a consumer
+   *
+   * All `basic.get` requests are sent before the first reply is read, so
+   * that @p count messages take one round trip.
+   * @param queue_name The queue to get the messages from.
+   * @param count The number of requests.
+   * @param no_ack The messages are considered acknowledged once sent.
+   * @param message_count Set to the number of messages left in the queue
+   * after the last request.
+   * @returns The messages, fewer than @p count when the queue ran empty
+   */
+  std::vector<AmqpEnvelope::Ptr> basicGet(
+    const std::string& queue_name,
+    std::size_t count,
+    bool no_ack,
+    std::uint32_t* message_count = nullptr);
+
   /**
    * Consumes a single message
    *
@@ -493,16 +940,39 @@ public:
    * This function only works after `BasicConsume` has successfully been called.
    *
    * @param consumer_tag Consumer ID (returned from \ref BasicConsume).
-   * @returns The next message on the queue
+   * @returns The next message on the queue, or `nullptr` on timeout or when
+   * another frame was read in its place. A close of the channel by the
+   * broker is acknowledged and returns `nullptr`, after which \ref isOpen
+   * is `false`; a close of the connection is acknowledged and thrown.
    */
   AmqpEnvelope::Ptr basicConsumeMessage(const struct timeval* timeout);
 
+  /**
+   * Consumes a single message matching a filter
+   *
+   * Like \ref basicConsumeMessage, but @p filter is called on the routing
+   * information and properties of every delivery before its body is read.
+   * The body of a delivery it returns `false` for is skipped on the socket
+   * without being copied, and the delivery is acked when @p ack is set.
+   *
+   * @param filter The predicate deliveries must match.
+   * @param ack Whether to ack the deliveries skipped.
+   * @returns The next matching message, or `nullptr` on timeout or when
+   * the broker closed the channel
+   */
+  AmqpEnvelope::Ptr basicConsumeMessage(
+    const struct timeval* timeout,
+    const std::function<bool(const AmqpDeliveryHead&)>& filter,
+    bool ack);
+
   static Ptr createInstance(const AmqpConnection::Ptr conn)
   {
     return std::make_shared<AmqpChannel>(conn);
   }
 
 private:
+  friend class AmqpPreparedPublish;
+
   AmqpChannel() = delete;
 
   struct Impl;
@@ -510,6 +980,73 @@ private:
   std::unique_ptr<Impl> m_impl;
 };
 
+/**
+ * A publish to a fixed exchange and routing key with fixed properties
+ *
+ * \ref AmqpChannel::basicPublish encodes the `basic.publish` method frame and
+ * the whole content header for every message. A prepared publish encodes the
+ * method frame and the static properties once; each \ref publish only
+ * writes the header frame from the cached bytes, patching in the body size
+ * and the correlation id, followed by the body frames, in a single system
+ * call.
+ *
+ * @note The frames are written straight to the connection's socket, so the
+ * connection must be a plain TCP one, \ref publish throws otherwise. It must
+ * not be used by another thread while publishing, like any other channel
+ * method.
+ */
+class AmqpPreparedPublish
+{
+public:
+  using Ptr = std::shared_ptr<AmqpPreparedPublish>;
+  using WPtr = std::weak_ptr<AmqpPreparedPublish>;
+
+  /**
+   * @param channel The channel to publish on.
+   * @param exchange The name of the exchange to publish to.
+   * @param routing_key The routing key to publish with.
+   * @param properties The properties sent with every message; its
+   * `correlation_id`, if any, is the default for \ref publish.
+   * @param mandatory Requires the message to be delivered to a queue.
+   * @param immediate Requires the message to be both routed to a queue, and
+   * immediately delivered to a consumer.
+   */
+  AmqpPreparedPublish(const AmqpChannel::Ptr channel,
+                      const std::string& exchange,
+                      const std::string& routing_key,
+                      const AmqpProperties& properties,
+                      bool mandatory = false,
+                      bool immediate = false);
+  virtual ~AmqpPreparedPublish();
+
+  /**
+   * Publishes a message
+   *
+   * @param body The message body.
+   * @param correlation_id Overrides the correlation id of the properties.
+   */
+  void publish(const std::string& body,
+               const std::optional<std::string>& correlation_id = {});
+
+  static Ptr createInstance(const AmqpChannel::Ptr channel,
+                            const std::string& exchange,
+                            const std::string& routing_key,
+                            const AmqpProperties& properties,
+                            bool mandatory = false,
+                            bool immediate = false)
+  {
+    return std::make_shared<AmqpPreparedPublish>(
+      channel, exchange, routing_key, properties, mandatory, immediate);
+  }
+
+private:
+  AmqpPreparedPublish() = delete;
+
+  struct Impl;
+  /// PIMPL idiom
+  std::unique_ptr<Impl> m_impl;
+};
+
 } // end namespace amqp
 
 class MessageBroker
@@ -532,6 +1069,63 @@ public:
   using TableEntry = amqp::AmqpTableEntry;
   using TableKey = amqp::AmqpTableKey;
   using TableValue = amqp::AmqpTableValue;
+  using QueueStats = amqp::AmqpQueueStats;
+
+  /// What becomes of a delivery found expired, see `Configuration::expiry`.
+  enum ExpiredAction
+  {
+    EXPIRED_ACK = 0,     ///< acked and dropped
+    EXPIRED_NACK = 1,    ///< rejected without requeue, i.e. dead-lettered
+    EXPIRED_CALLBACK = 2 ///< passed to `expiry.callback` instead
+  };
+
+  /// What a publish does while the broker blocks publishing connections, see
+  /// `Configuration::blocked`.
+  enum BlockedAction
+  {
+    BLOCKED_QUEUE = 0, ///< waits until unblocked, for at most `max_wait`
+    BLOCKED_FAIL = 1,  ///< throws at once
+    BLOCKED_SPOOL = 2  ///< kept by the batching thread until unblocked
+  };
+
+  /**
+   * @brief Token bucket limiting the rate of publishes, shared by every
+   * configuration referring to it.
+   *
+   * Implemented as a virtual scheduling (GCRA) on a single atomic, so that
+   * concurrent publishers never take a lock.
+   */
+  class RateLimit
+  {
+  public:
+    using Ptr = std::shared_ptr<RateLimit>;
+
+    /// @param[in]  rate   Messages per second
+    /// @param[in]  burst  Messages which may be sent at once after a pause
+    RateLimit(double rate, double burst = 1);
+
+    static Ptr createInstance(double rate, double burst = 1)
+    {
+      return std::make_shared<RateLimit>(rate, burst);
+    }
+
+    /// Takes a token, waiting until one is available.
+    void acquire();
+
+    /// Takes a token if one is available, without waiting; otherwise sets
+    /// @p wait, when given, to the time until one is.
+    bool tryAcquire(std::chrono::nanoseconds* wait = nullptr);
+
+  private:
+    /// Reserves the next token and returns how long until it is available;
+    /// with @p wait unset nothing is reserved unless it is available now.
+    std::chrono::nanoseconds reserve(bool wait);
+
+    std::chrono::nanoseconds m_interval;
+    std::chrono::nanoseconds m_tolerance;
+    /// theoretical arrival time of the next message, in steady clock ns
+    std::atomic<std::int64_t> m_tat{ 0 };
+  };
 
   /**
    * @brief Class for specifying the RabbitMQ queue and exchange
@@ -539,7 +1133,7 @@ public:
    */
   struct Configuration
   {
-    struct
+    struct Exchange
     {
       std::string name = "";
       std::string type = "";
@@ -550,7 +1144,7 @@ public:
       bool declare = false;
       std::optional<Table> arguments;
     } exchange;
-    struct
+    struct Queue
     {
       std::string name = "";
       bool passive = false;
@@ -561,8 +1155,229 @@ public:
       bool bind = false;
       std::optional<Table> arguments;
     } queue;
+    struct
+    {
+      /// Deliveries are considered acknowledged once sent by the broker. When
+      /// `false` every message is acked after its callback returns, so an
+      /// unprocessed message is redelivered rather than lost.
+      bool no_ack = true;
+      /// Unacknowledged deliveries buffered by each consumer, 0 for no
+      /// limit. Has no effect with `no_ack`.
+      std::uint16_t prefetch = 0;
+      /// Tunes the prefetch of each consumer, starting from `prefetch`, once
+      /// per second: to the deliveries handled during one round trip to the
+      /// broker, and doubled while the handler waits for deliveries although
+      /// the queue is not empty. Has no effect with `no_ack`.
+      bool adaptive_prefetch = false;
+      std::uint16_t max_prefetch = 1000;
+      struct
+      {
+        /// Bounds of the number of consumers of the subscription, each with
+        /// its own connection and thread. More than one consumer needs a
+        /// named queue, which they share.
+        std::size_t min = 1;
+        std::size_t max = 1;
+        /// A consumer is added when the queue depth, at the 90th percentile
+        /// of the recent handler times, would take longer than this to work
+        /// off with the current consumers. The depth is sampled, see
+        /// monitor().
+        std::chrono::milliseconds max_latency{ 1000 };
+        /// A consumer above `min` stops after receiving nothing for this
+        /// long.
+        std::chrono::milliseconds idle{ 30000 };
+      } scaling;
+      struct
+      {
+        /// When the broker cancels a consumer, e.g. as its queue was deleted
+        /// or the node of the queue failed, the queue is declared again and
+        /// consumed from anew; a lost connection is opened again. Failed
+        /// attempts are retried after a delay doubling from `min_delay` up
+        /// to `max_delay`.
+        std::chrono::milliseconds min_delay{ 10 };
+        std::chrono::milliseconds max_delay{ 5000 };
+      } resubscribe;
+    } consumer;
+    struct
+    {
+      /// Bodies larger than `threshold` bytes are put in `store` and
+      /// published as a reference; received references are resolved from
+      /// `store` when the body is first read.
+      amqp::AmqpBlobStore::Ptr store;
+      std::size_t threshold = 1024 * 1024;
+      /// A body is removed from `store` again when its publish fails, and
+      /// by the consumer once its message was handled and acked, or dropped
+      /// as expired or duplicate; a retried or dead-lettered message keeps
+      /// it. Set to `false` when a message reaches several queues, e.g.
+      /// through fan-out: cleaning up the store is then up to the
+      /// application.
+      bool remove = true;
+    } claim_check;
+    struct
+    {
+      /// Queue whose depth throttles publishing, typically the queue the
+      /// messages are routed to. Its depth is sampled, see monitor().
+      std::string queue = "";
+      /// Publishing is throttled while the queue holds more than `max_depth`
+      /// ready messages; 0 disables backpressure.
+      std::uint32_t max_depth = 0;
+      /// Without a `hook`, a throttled publish waits until the depth drops
+      /// below `max_depth`, for at most `max_wait`, then publishes anyway.
+      std::chrono::milliseconds max_wait{ 5000 };
+      /// Called instead of waiting, e.g. to shed load by throwing.
+      std::function<void(const QueueStats&)> hook;
+    } backpressure;
+    struct
+    {
+      /// Applied while a publishing connection of the broker is blocked by
+      /// a resource alarm. The state is learned from the connections which
+      /// stay open (batching and asynchronous), whose messages are held
+      /// until unblocked instead of hanging in a write. Asynchronous
+      /// publishes are not affected, waiting would stall run().
+      ///
+      /// A synchronous publish opens its own connection, which learns of a
+      /// block only once it wrote its message: the action has no effect on
+      /// it unless batching or asynchronous publishes run alongside. Its
+      /// replies are waited for at most `max_wait` (30 s when 0), and a
+      /// plain publish finding its connection blocked throws, as the
+      /// message may not have reached the broker. The same bound applies
+      /// to the writes of publishBatch() and of the batching thread, whose
+      /// batch then fails.
+      BlockedAction action = BLOCKED_QUEUE;
+      /// Time a BLOCKED_QUEUE publish waits before throwing; 0 waits as long
+      /// as the block lasts.
+      std::chrono::milliseconds max_wait{ 0 };
+      /// Messages BLOCKED_SPOOL holds at most, beyond which it throws. Only
+      /// plain publishes are spooled, others behave as with BLOCKED_QUEUE.
+      std::size_t max_spool = 100000;
+    } blocked;
+    struct
+    {
+      /// Publishes are handed to a background thread, which writes them on
+      /// a shared connection in batches. publish() then returns before the
+      /// message is sent; errors are counted in metrics() instead of thrown.
+      /// The exchange and queue are declared by the first publish only.
+      bool enabled = false;
+      /// Longest time a message waits for others to share its write. A
+      /// message is written at once when the average time between publishes
+      /// exceeds it, so batches grow with the publishing rate only.
+      std::chrono::microseconds max_delay{ 200 };
+      /// Largest number of messages written at once.
+      std::size_t max_messages = 256;
+      /// Writes on a separate connection and thread, so that e.g. control
+      /// messages never wait behind bulk ones.
+      bool priority = false;
+    } batching;
+    /// Publishes wait for a token of this bucket first, unset for no limit.
+    RateLimit::Ptr rate_limit;
+    struct
+    {
+      /// Deliveries whose `message_id`, or claim check reference or body
+      /// when it has none, was already handled by the subscription, or is
+      /// being handled by another of its consumers, are acked and skipped
+      /// before the callback.
+      bool enabled = false;
+      /// Deliveries are remembered for one to two windows.
+      std::chrono::seconds window{ 60 };
+      /// Expected deliveries per window, which sizes the Bloom filters.
+      std::size_t capacity = 100000;
+      /// Probability that a delivery which is not among the `exact` most
+      /// recent ones is mistaken for a duplicate.
+      double false_positive_rate = 1e-6;
+      /// Most recent keys compared exactly.
+      std::size_t exact = 4096;
+    } dedupe;
+    struct
+    {
+      /// Deliveries whose callback threw are republished to a delay queue
+      /// and come back after `delay`, multiplied by `multiplier` on every
+      /// further attempt, until `max_attempts` attempts failed; 0 disables
+      /// retries. Delay queues are declared per delay, named after the queue
+      /// and the delay, route expired messages back to the queue and are
+      /// deleted by the broker once unused for a while. Server-named and
+      /// exclusive queues are not retried, their deliveries go to
+      /// `dead_letter_exchange` at once.
+      std::size_t max_attempts = 0;
+      std::chrono::milliseconds delay{ 1000 };
+      double multiplier = 2;
+      /// Header counting the failed attempts.
+      std::string header = "x-retry-count";
+      /// Exchange receiving deliveries once attempts are exhausted, with
+      /// their routing key. When empty they are rejected without requeue,
+      /// i.e. go to the dead-letter exchange of the queue if it has one.
+      std::string dead_letter_exchange = "";
+    } retry;
+    /// Publishes with the `mandatory` flag: messages which no queue accepts
+    /// are passed to the onReturn() callback instead of being dropped.
+    bool mandatory = false;
+    /// Deliveries for which this returns `false` are acked and skipped, before
+    /// their body is read.
+    std::function<bool(const amqp::AmqpDeliveryHead&)> filter;
+    struct
+    {
+      /// Deliveries past their deadline are not passed to the callback.
+      /// The deadline is `timestamp` plus `expiration`, or the milliseconds
+      /// since the epoch in header `header`, whichever comes first.
+      bool enabled = false;
+      std::string header = "x-deadline";
+      /// With `no_ack` deliveries are acked already, and EXPIRED_NACK drops
+      /// them as EXPIRED_ACK does.
+      ExpiredAction action = EXPIRED_ACK;
+      std::function<void(const Message&)> callback;
+    } expiry;
     std::string routing_key = "";
     std::string routing_pattern = "";
+    /// Arguments of the queue binding, e.g. for a `headers` exchange
+    /// `{"x-match": "all", "kind": "invoice"}` routes on message headers.
+    std::optional<Table> binding_arguments;
+  };
+
+  /**
+   * @brief A binding routing messages from an exchange to a queue, or to
+   * another exchange when `exchange` is set.
+   */
+  struct Binding
+  {
+    std::string source = "";
+    std::string destination = "";
+    bool exchange = false;
+    std::string routing_key = "";
+    std::optional<Table> arguments;
+  };
+
+  /**
+   * @brief A set of exchanges, queues and bindings applied together, see
+   * MessageBroker::declare(const Topology&).
+   */
+  struct Topology
+  {
+    std::vector<Configuration::Exchange> exchanges;
+    std::vector<Configuration::Queue> queues;
+    std::vector<Binding> bindings;
+
+    /**
+     * @brief Load a topology from a key file (INI):
+     *
+     *     [exchange orders]
+     *     type=topic
+     *     durable=true
+     *
+     *     [queue orders.created]
+     *     durable=true
+     *     argument.x-message-ttl=60000
+     *
+     *     [binding created]
+     *     source=orders
+     *     destination=orders.created
+     *     routing_key=order.created
+     *     argument.x-match=any
+     *
+     * Exchange and queue groups accept the flags of Configuration; each
+     * `argument.<name>` key becomes a table entry (`true`/`false` as bool,
+     * integers as int64, anything else as string), for bindings too. A
+     * binding whose `destination_type` is `exchange` binds exchange to
+     * exchange.
+     */
+    static Topology load(const std::string& path);
   };
 
   ///
@@ -595,6 +1410,107 @@ public:
     static Ptr createInstance() { return std::make_shared<Response>(); }
   };
 
+  /**
+   * @brief A snapshot of the broker's counters, see metrics().
+   */
+  struct Metrics
+  {
+    struct Subscription
+    {
+      std::string queue;
+      std::uint64_t delivered = 0;
+      /// Messages ready in the queue at its last sample, i.e. how far this
+      /// consumer is behind; empty until the queue has been sampled.
+      std::optional<std::uint32_t> lag;
+      /// Time spent in the callback, in total.
+      std::chrono::nanoseconds handler_time{ 0 };
+      /// 90th percentile of the handler time between the last two samples.
+      std::chrono::nanoseconds handler_p90{ 0 };
+      /// Current number of consumers, see `Configuration::consumer.scaling`.
+      std::size_t consumers = 0;
+      /// Prefetch last set on a consumer, see
+      /// `Configuration::consumer.adaptive_prefetch`.
+      std::uint16_t prefetch = 0;
+      /// Round trip time to the broker, measured on basic.qos.
+      std::chrono::nanoseconds rtt{ 0 };
+      /// Deliveries skipped as duplicates, see `Configuration::dedupe`.
+      std::uint64_t duplicates = 0;
+      /// Deliveries found expired, see `Configuration::expiry`.
+      std::uint64_t expired = 0;
+      /// Deliveries skipped by `Configuration::filter`.
+      std::uint64_t filtered = 0;
+      /// Deliveries whose callback threw, see `Configuration::retry`: sent
+      /// to a delay queue, to a dead-letter exchange or rejected, or lost
+      /// as they were consumed with `no_ack` and had nowhere to go.
+      std::uint64_t failed = 0;
+      std::uint64_t retried = 0;
+      std::uint64_t dead_lettered = 0;
+      std::uint64_t dropped = 0;
+      /// Failed deliveries whose retry failed as well, e.g. as the delay
+      /// queue exists with other arguments; they were rejected instead,
+      /// dropped with `no_ack`, or requeued when the channel was lost.
+      std::uint64_t retry_errors = 0;
+      /// Times a consumer was cancelled by the broker and subscribed again,
+      /// see `Configuration::consumer.resubscribe`.
+      std::uint64_t resubscribed = 0;
+      /// Times a consumer lost its connection, e.g. on a broker failover, or
+      /// failed to open one; it connects again with the backoff of
+      /// `Configuration::consumer.resubscribe`.
+      std::uint64_t connection_errors = 0;
+    };
+
+    /// Batched publishing, see `Configuration::batching`.
+    struct Publisher
+    {
+      std::uint64_t messages = 0;
+      std::uint64_t batches = 0;
+      /// Messages dropped as their batch could not be written.
+      std::uint64_t failed = 0;
+      /// Moving averages of the batch size, of the time between publishes
+      /// and of the time messages wait before being written.
+      double batch_size = 0;
+      std::chrono::nanoseconds arrival_gap{ 0 };
+      std::chrono::nanoseconds delay{ 0 };
+    };
+
+    /// A key with the estimate of its count, see trackHotKeys().
+    struct HotKey
+    {
+      std::string key;
+      std::uint64_t count = 0;
+    };
+
+    /// The most frequent keys of the last complete window, most frequent
+    /// first.
+    struct HotKeys
+    {
+      std::vector<HotKey> routing_keys;
+      std::vector<HotKey> types;
+    };
+
+    /// The last sample of every monitored queue, by name.
+    std::map<std::string, QueueStats> queues;
+    std::vector<Subscription> subscriptions;
+    Publisher publisher;
+    /// The priority lane, see `Configuration::batching.priority`.
+    Publisher priority_publisher;
+    /// Messages returned as unroutable, see `Configuration::mandatory`.
+    std::uint64_t returned = 0;
+    /// Whether a publishing connection is blocked by the broker, why, and
+    /// for how long publishing was blocked in total, see
+    /// `Configuration::blocked`.
+    bool blocked = false;
+    std::string blocked_reason;
+    std::chrono::nanoseconds blocked_time{ 0 };
+    /// Empty until trackHotKeys() is called.
+    HotKeys published_keys;
+    HotKeys consumed_keys;
+    /// The frame_max and socket buffer size of new connections, see
+    /// adaptFrames(); a socket_buffer of 0 leaves the kernel's.
+    int frame_max = 0;
+    int socket_buffer = 0;
+  };
+
   /**
    * @brief Parse a connection URL and establish an amqp connection.
    * An amqp connection url takes the form:
@@ -636,6 +1552,28 @@ public:
   ///
   void publish(const Configuration& configuration, Message message);
 
+  /// Fan-out messaging pattern: publish one message to several exchanges.
+  ///
+  /// The first call for a set of destinations declares a fanout exchange
+  /// (`configuration.exchange`, named after the destinations when its name is
+  /// empty) and binds every destination exchange to it. Each message is then
+  /// sent once and replicated by the broker instead of being published once
+  /// per destination, which divides egress by the number of destinations.
+  /// The destinations route it with `configuration.routing_key`.
+  ///
+  /// When a later call lists other destinations for the same fanout exchange,
+  /// the destinations bound by this broker which are no longer listed are
+  /// unbound first, so that they stop receiving copies. Bindings made by
+  /// other processes are not known and stay.
+  ///
+  /// @param[in]  configuration  The configuration of the fanout exchange
+  /// @param[in]  destinations   The exchanges to deliver the message to
+  /// @param[in]  message        The messagebody
+  ///
+  void publish(const Configuration& configuration,
+               const std::vector<std::string>& destinations,
+               Message message);
+
   /// RPC messaging pattern for publish events.
   ///
   /// @param[in]  configuration  The configuration
@@ -665,8 +1603,273 @@ public:
   void subscribe(const Configuration& configuration,
                  std::function<bool(const Request&, Response&)> callback);
 
+  /// Publishes several messages all or nothing.
+  ///
+  /// The messages are published in a transaction on one channel: they are
+  /// written at once, and committed with a single `tx.commit` round trip.
+  /// When publishing or committing fails, the transaction is rolled back
+  /// when possible and the error thrown; no message is routed then.
+  ///
+  /// @param[in]  configuration  The configuration
+  /// @param[in]  messages       The messages
+  ///
+  void publishBatch(const Configuration& configuration,
+                    std::vector<Message> messages);
+
+  /// Drains a queue with `basic.get` and returns once it is empty.
+  ///
+  /// Requests are pipelined by the number of messages left in the queue, as
+  /// reported by each reply, which also tells when the queue is empty: no
+  /// timeout is waited for. Messages are acked after @p callback returns
+  /// unless `consumer.no_ack` is set.
+  ///
+  /// @param[in]  configuration  The configuration
+  /// @param[in]  max_messages   Messages to handle at most, 0 for no limit
+  /// @param[in]  callback       The callback
+  ///
+  /// @return     the number of messages handled
+  ///
+  std::size_t drain(const Configuration& configuration,
+                    std::size_t max_messages,
+                    std::function<void(const Message&)> callback);
+
+  /// Asynchronous publish, completed by run().
+  ///
+  /// The asynchronous calls share one connection, driven by the thread
+  /// calling run() or runOnce(); they must all be made from that thread, e.g.
+  /// from their own callbacks. No thread is started per operation. The
+  /// exchange and queue are declared by the first call for a configuration.
+  ///
+  /// With `Configuration::rate_limit` set, a publish over the rate is not
+  /// waited for but deferred by run() until its token is due.
+  ///
+  /// @param[in]  configuration  The configuration
+  /// @param[in]  message        The messagebody
+  /// @param[in]  done           Called from run() once the message is written
+  ///
+  void publishAsync(const Configuration& configuration,
+                    Message message,
+                    std::function<void()> done);
+
+  /// Asynchronous RPC call, completed by run().
+  ///
+  /// Replies come through RabbitMQ's direct reply-to pseudo queue, so that
+  /// any number of calls share one consumer and no reply queue is declared;
+  /// they are matched to their call by correlation id.
+  ///
+  /// A call over `Configuration::rate_limit` is deferred as by
+  /// publishAsync(); the wait counts against @p timeout.
+  ///
+  /// @param[in]  configuration  The configuration
+  /// @param[in]  request        The request
+  /// @param[in]  timeout        Time to wait for the response
+  /// @param[in]  done           Called from run() with the response, or with
+  ///                            nullptr once @p timeout elapsed
+  ///
+  void callAsync(const Configuration& configuration,
+                 Request request,
+                 std::chrono::milliseconds timeout,
+                 std::function<void(Response::Ptr)> done);
+
+  /// Asynchronous subscription, dispatched by run().
+  ///
+  /// A message whose callback throws is rejected; the exception is rethrown
+  /// by run() once the other completions of the round ran.
+  ///
+  /// @param[in]  configuration  The configuration
+  /// @param[in]  callback       Called from run() for every message
+  ///
+  /// @return     the consumer tag, for cancelAsync()
+  ///
+  std::string consumeAsync(const Configuration& configuration,
+                           std::function<void(const Message&)> callback);
+
+  /// Asynchronous subscription whose messages are acknowledged by
+  /// ackAsync() or nackAsync(), possibly after the callback returned. At
+  /// most `Configuration::consumer.prefetch` of them are unacknowledged.
+  ///
+  /// @param[in]  configuration  The configuration
+  /// @param[in]  callback       Called from run() for every message, with
+  ///                            its delivery tag
+  ///
+  /// @return     the consumer tag, for cancelAsync()
+  ///
+  std::string consumeAsync(
+    const Configuration& configuration,
+    std::function<void(const Message&, std::uint64_t delivery_tag)> callback);
+
+  /// Acknowledges a message of consumeAsync() with manual acknowledgement.
+  /// Tags of a connection replaced since are ignored.
+  ///
+  /// @param[in]  delivery_tag  The tag passed to the callback
+  ///
+  void ackAsync(std::uint64_t delivery_tag);
+
+  /// Rejects a message of consumeAsync() with manual acknowledgement.
+  ///
+  /// @param[in]  delivery_tag  The tag passed to the callback
+  /// @param[in]  requeue       Whether the message is delivered again
+  ///
+  void nackAsync(std::uint64_t delivery_tag, bool requeue);
+
+  /// Ends a subscription of consumeAsync(). Messages delivered before the
+  /// server got the cancel are requeued.
+  ///
+  /// @param[in]  consumer_tag  The tag returned by consumeAsync()
+  ///
+  void cancelAsync(const std::string& consumer_tag);
+
+  /// Runs the asynchronous operations until none is pending, or forever once
+  /// there is a subscription, until close().
+  ///
+  void run();
+
+  /// Runs asynchronous completions once, waiting at most @p timeout for the
+  /// connection to receive something.
+  ///
+  /// An exception thrown by a callback is rethrown once the other
+  /// completions of the round ran; the operations left pending stay so.
+  ///
+  /// @return     whether a completion ran
+  ///
+  bool runOnce(std::chrono::milliseconds timeout);
+
+  /// The socket of the asynchronous calls, to drive them from an external
+  /// event loop instead of run(); -1 before the first asynchronous call. It
+  /// changes when a channel closed by the server is replaced by a new
+  /// connection.
+  ///
+  int fd() const;
+
+  /// The poll events wanted on fd().
+  ///
+  short events() const;
+
+  /// When process() must run at the latest, even if fd() is not readable:
+  /// at once while completions or buffered frames are pending, else at the
+  /// next call timeout or heartbeat. Empty when nothing is waited for.
+  ///
+  std::optional<std::chrono::steady_clock::time_point> deadline() const;
+
+  /// Runs the asynchronous completions which are ready, without blocking:
+  /// one read of fd(), then the frames and completions it left pending.
+  ///
+  /// @return     whether a completion ran
+  ///
+  bool process();
+
+  /// Creates a GLib source calling process() from a main loop, to attach
+  /// with `g_source_attach()`; it follows fd() as it changes. The broker
+  /// must outlive it.
+  ///
+  GSource* createSource();
+
+  /// Adapts frame_max and socket buffers to the sizes of the messages.
+  ///
+  /// The body sizes of the messages published and consumed are recorded in
+  /// a histogram, along with the largest properties. Every new connection
+  /// (synchronous publishes, subscription consumers, batching threads
+  /// reconnecting) then asks for the smallest frame_max, a multiple of
+  /// 4 KiB, which carries the 99th percentile of bodies in a single frame
+  /// and the largest header frame seen, such as one with a big headers
+  /// table: rabbitmq-c allocates its buffers by frame_max, so small messages
+  /// save memory while large ones are split into fewer frames. The socket
+  /// buffers are enlarged to hold two such messages.
+  ///
+  /// The frame_max is at most @p max_frame, replacing the one given to the
+  /// constructor, and at most the broker's limit once a connection learned
+  /// it (RabbitMQ's default is 131072, beyond which bodies are split
+  /// anyway).
+  ///
+  /// With a @p profile path, the histogram is loaded from that key file when
+  /// it exists and saved to it by close(), so that the next start is tuned
+  /// from its first connection.
+  ///
+  /// @param[in]  profile    The path of the size profile, or empty
+  /// @param[in]  max_frame  The largest frame_max to ask for
+  ///
+  void adaptFrames(const std::string& profile = "", int max_frame = 1 << 20);
+
+  /// Sets the callback of messages returned as unroutable.
+  ///
+  /// Messages published with `configuration.mandatory` which no queue
+  /// accepts are returned by the broker about a round trip later. They are
+  /// read without blocking the publisher: by the batching thread, by run(),
+  /// or when the connection of a synchronous publish is closed. The message
+  /// comes back unchanged with its exchange and routing key, so it can be
+  /// matched to its publish by `message_id` or `correlation_id`. Returned
+  /// asynchronous calls complete with nullptr at once. The callback may be
+  /// called from any publishing thread.
+  ///
+  /// @param[in]  callback  The callback
+  ///
+  void onReturn(std::function<void(const amqp::AmqpReturn&)> callback);
+
+  /// Declares the exchanges, queues and bindings of several configurations.
+  ///
+  /// Declarations are pipelined: all but the last one are sent with the
+  /// `nowait` bit, and the reply to the last one confirms the whole batch, so
+  /// the topology is set up in about one round trip instead of one per entity.
+  /// A failing declaration is reported as an exception. Queues without a name
+  /// are declared synchronously since their name is needed for binding.
+  ///
+  /// @param[in]  configurations  The configurations
+  ///
+  void declare(const std::vector<Configuration>& configurations);
+
+  /// Applies a topology in bulk.
+  ///
+  /// Declarations are pipelined as with the bulk declare() of configurations.
+  /// Every entity applied successfully is remembered by a fingerprint of its
+  /// definition, and unchanged entities are skipped on the next call, so the
+  /// topology can be re-applied cheaply, e.g. on every service start or
+  /// configuration reload. Exclusive queues are never remembered since they
+  /// disappear with the connection used to apply them.
+  ///
+  /// @param[in]  topology  The topology, e.g. from Topology::load()
+  ///
+  void declare(const Topology& topology);
+
+  /// Samples queue depth and consumer count periodically.
+  ///
+  /// The queues are passively declared on a dedicated connection every
+  /// @p interval, together with the queue of every subscription and of every
+  /// `backpressure` configuration. Further calls add queues and change the
+  /// interval.
+  ///
+  /// @param[in]  queue_names  The queues to sample
+  /// @param[in]  interval     The sampling interval
+  ///
+  void monitor(const std::vector<std::string>& queue_names = {},
+               std::chrono::milliseconds interval = std::chrono::seconds(1));
+
+  /// Counters of the sampled queues and of the subscriptions.
+  ///
+  Metrics metrics() const;
+
+  /// Tracks the most frequent routing keys and message types.
+  ///
+  /// Every message published and consumed from then on is counted in a
+  /// count-min sketch per time window, in constant memory whatever the
+  /// number of distinct keys, and the @p top keys with the highest counts
+  /// are reported by metrics(). Counting a message takes a hash and a few
+  /// relaxed atomic increments; a lock is only taken while a key enters the
+  /// top. Further calls restart tracking with new parameters.
+  ///
+  /// @param[in]  top     The number of keys reported per kind
+  /// @param[in]  window  The length of a window
+  ///
+  void trackHotKeys(
+    std::size_t top = 10,
+    std::chrono::milliseconds window = std::chrono::seconds(10));
+
   /// Close all subscription and join threads.
   ///
+  /// Every subscription is drained before its connection is closed: the
+  /// consumer is cancelled with `basic.cancel`, messages the broker delivered
+  /// before `basic.cancel-ok` are still handed to the callback (and acked when
+  /// `consumer.no_ack` is `false`), and only then is the channel closed.
+  ///
   void close();
 
   /// Generate random id
@@ -676,6 +1879,52 @@ private:
   std::tuple<std::string, std::string> setup(const Configuration& cfg,
                                              amqp::AmqpChannel::Ptr channel);
 
+  void declare(const std::vector<Configuration>& configurations,
+               amqp::AmqpChannel::Ptr channel);
+
+  void throttle(const Configuration& cfg);
+
+  bool admit(const Configuration& cfg, bool spool);
+
+  void record(bool consumed,
+              const std::string& routing_key,
+              const Message& message);
+
+  void watch(amqp::AmqpConnection::Ptr conn);
+
+  amqp::AmqpConnection::Ptr connect();
+
+  amqp::AmqpConnection::Ptr connectPublisher(
+    std::chrono::milliseconds max_wait);
+
+  bool enqueue(const Configuration& cfg,
+               Message& msg,
+               bool spool,
+               std::vector<std::string>& claims);
+
+  void openAsync();
+
+  std::tuple<std::shared_ptr<const Configuration>, std::string, std::string>
+  prepare(const Configuration& cfg);
+
+  void flush(std::size_t lane);
+
+  void handleReturn(const amqp::AmqpReturn& message);
+
+  void consume(const Configuration& cfg,
+               std::function<void(amqp::AmqpChannel::Ptr,
+                                  const amqp::AmqpEnvelope&)> handler);
+
+  struct ConsumerGroup;
+
+  void sample(const std::vector<std::string>& queue_names);
+
+  void scale();
+
+  void spawn(std::shared_ptr<ConsumerGroup> group);
+
+  void reap();
+
   struct Impl;
   /// PIMPL idiom
   std::unique_ptr<Impl> m_impl;
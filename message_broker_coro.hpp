@@ -0,0 +1,306 @@
+#ifndef MESSAGE_BROKER_CORO_H
+#define MESSAGE_BROKER_CORO_H
+
+#include "message_broker.hpp"
+
+#if !defined(__cpp_impl_coroutine)
+#error "message_broker_coro.hpp needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace gs {
+namespace coro {
+
+///
+/// Awaitables over the asynchronous calls of MessageBroker. They resume from
+/// MessageBroker::run(), on the thread running it, so one thread drives any
+/// number of coroutines without a thread per operation.
+///
+/// @code
+/// coro::Task client(MessageBroker& broker, MessageBroker::Configuration cfg)
+/// {
+///   MessageBroker::Request req;
+///   req.body() = "30";
+///   auto res = co_await coro::call(broker, cfg, req);
+/// }
+/// @endcode
+///
+
+/// A coroutine started at once. Awaiting it resumes once it ends, rethrowing
+/// its exception; dropping it lets it run on its own, and an exception it
+/// then ends with, which nothing is left to catch, calls std::terminate(),
+/// as one leaving a thread function does.
+class Task
+{
+public:
+  struct promise_type
+  {
+    std::exception_ptr exception;
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+
+    Task get_return_object()
+    {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_never initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter
+    {
+      bool await_ready() const noexcept { return false; }
+
+      std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<promise_type> handle) noexcept
+      {
+        auto& promise = handle.promise();
+        if (promise.continuation)
+          return promise.continuation;
+        if (promise.detached) {
+          if (promise.exception)
+            std::terminate();
+          handle.destroy();
+        }
+        return std::noop_coroutine();
+      }
+
+      void await_resume() const noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void return_void() {}
+
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  Task(Task&& other) noexcept
+    : m_handle(std::exchange(other.m_handle, {}))
+  {
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task()
+  {
+    if (!m_handle)
+      return;
+    auto& promise = m_handle.promise();
+    if (!m_handle.done()) {
+      promise.detached = true;
+      return;
+    }
+    if (promise.exception)
+      std::terminate();
+    m_handle.destroy();
+  }
+
+  bool await_ready() const noexcept { return m_handle.done(); }
+
+  void await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    m_handle.promise().continuation = handle;
+  }
+
+  void await_resume()
+  {
+    if (auto exception = std::exchange(m_handle.promise().exception, nullptr))
+      std::rethrow_exception(exception);
+  }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> handle)
+    : m_handle(handle)
+  {
+  }
+
+  std::coroutine_handle<promise_type> m_handle;
+};
+
+/// Awaitable publish, resuming once the message is written. An exception of
+/// MessageBroker::publishAsync() is thrown at the await.
+class Publish
+{
+public:
+  Publish(MessageBroker& broker,
+          MessageBroker::Configuration configuration,
+          MessageBroker::Message message)
+    : m_broker(broker)
+    , m_configuration(std::move(configuration))
+    , m_message(std::move(message))
+  {
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle)
+  {
+    m_broker.publishAsync(m_configuration,
+                          std::move(m_message),
+                          [handle]() { handle.resume(); });
+  }
+
+  void await_resume() const noexcept {}
+
+private:
+  MessageBroker& m_broker;
+  MessageBroker::Configuration m_configuration;
+  MessageBroker::Message m_message;
+};
+
+/// Awaitable RPC call, resuming with the response, or nullptr on timeout.
+class Call
+{
+public:
+  Call(MessageBroker& broker,
+       MessageBroker::Configuration configuration,
+       MessageBroker::Request request,
+       std::chrono::milliseconds timeout)
+    : m_broker(broker)
+    , m_configuration(std::move(configuration))
+    , m_request(std::move(request))
+    , m_timeout(timeout)
+  {
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle)
+  {
+    m_broker.callAsync(m_configuration,
+                       std::move(m_request),
+                       m_timeout,
+                       [this, handle](MessageBroker::Response::Ptr response) {
+                         m_response = std::move(response);
+                         handle.resume();
+                       });
+  }
+
+  MessageBroker::Response::Ptr await_resume() noexcept
+  {
+    return std::move(m_response);
+  }
+
+private:
+  MessageBroker& m_broker;
+  MessageBroker::Configuration m_configuration;
+  MessageBroker::Request m_request;
+  std::chrono::milliseconds m_timeout;
+  MessageBroker::Response::Ptr m_response;
+};
+
+/// Messages of a subscription, as an asynchronous sequence:
+/// `for (;;) { auto message = co_await deliveries.next(); ... }`
+///
+/// The subscription lasts as long as the object. A message is acknowledged
+/// once next() hands it over; those arriving while no coroutine awaits it
+/// are buffered, at most `Configuration::consumer.prefetch` (64 unless set)
+/// of them, and requeued when the object is destroyed.
+class Deliveries
+{
+  struct State
+  {
+    MessageBroker* broker;
+    std::deque<std::pair<MessageBroker::Message, std::uint64_t>> messages;
+    std::coroutine_handle<> waiting;
+  };
+
+public:
+  class Next
+  {
+  public:
+    explicit Next(std::shared_ptr<State> state)
+      : m_state(std::move(state))
+    {
+    }
+
+    bool await_ready() const noexcept { return !m_state->messages.empty(); }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      m_state->waiting = handle;
+    }
+
+    MessageBroker::Message await_resume()
+    {
+      auto [message, delivery_tag] = std::move(m_state->messages.front());
+      m_state->messages.pop_front();
+      m_state->broker->ackAsync(delivery_tag);
+      return std::move(message);
+    }
+
+  private:
+    std::shared_ptr<State> m_state;
+  };
+
+  Deliveries(MessageBroker& broker,
+             const MessageBroker::Configuration& configuration)
+    : m_broker(broker)
+    , m_state(std::make_shared<State>(State{ &broker, {}, {} }))
+  {
+    // the prefetch bounds the buffer
+    auto cfg = configuration;
+    if (!cfg.consumer.no_ack && cfg.consumer.prefetch == 0)
+      cfg.consumer.prefetch = 64;
+    m_consumer_tag = broker.consumeAsync(
+      cfg,
+      [state = m_state](const MessageBroker::Message& msg,
+                        std::uint64_t delivery_tag) {
+        state->messages.emplace_back(msg, delivery_tag);
+        if (auto waiting = std::exchange(state->waiting, {}))
+          waiting.resume();
+      });
+  }
+
+  Deliveries(const Deliveries&) = delete;
+  Deliveries& operator=(const Deliveries&) = delete;
+
+  ~Deliveries()
+  {
+    try {
+      m_broker.cancelAsync(m_consumer_tag);
+      for (const auto& [message, delivery_tag] : m_state->messages) {
+        m_broker.nackAsync(delivery_tag, true);
+      }
+    } catch (const std::exception&) {
+      // the connection is gone, and the subscription with it
+    }
+  }
+
+  Next next() { return Next(m_state); }
+
+private:
+  MessageBroker& m_broker;
+  std::string m_consumer_tag;
+  std::shared_ptr<State> m_state;
+};
+
+inline Publish
+publish(MessageBroker& broker,
+        MessageBroker::Configuration configuration,
+        MessageBroker::Message message)
+{
+  return Publish(broker, std::move(configuration), std::move(message));
+}
+
+inline Call
+call(MessageBroker& broker,
+     MessageBroker::Configuration configuration,
+     MessageBroker::Request request,
+     std::chrono::milliseconds timeout = std::chrono::seconds(30))
+{
+  return Call(broker, std::move(configuration), std::move(request), timeout);
+}
+
+} // end namespace coro
+} // end namespace gs
+
+#endif
@@ -0,0 +1,359 @@
+// Checks of the parts of message_broker.cpp which need no broker: the
+// hand-written property encoder against rabbitmq-c's decoder, and the rate
+// limit, deduplication, hot key and frame sizing helpers. The source is
+// included to reach its file-local helpers.
+//
+// usage: message_broker_test
+
+#include "../message_broker.cpp"
+
+#include <iostream>
+#include <rabbitmq-c/framing.h>
+
+using namespace gs;
+using namespace gs::amqp;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition              \
+                << std::endl;                                                  \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static bool
+same(const AmqpTable& a, const AmqpTable& b);
+
+static bool
+same(const AmqpTableValue& a, const AmqpTableValue& b)
+{
+  if (a.getType() != b.getType())
+    return false;
+  switch (a.getType()) {
+    case AmqpTableValue::VT_bool:
+      return a.getBool() == b.getBool();
+    case AmqpTableValue::VT_int8:
+      return a.getInt8() == b.getInt8();
+    case AmqpTableValue::VT_int16:
+      return a.getInt16() == b.getInt16();
+    case AmqpTableValue::VT_int32:
+      return a.getInt32() == b.getInt32();
+    case AmqpTableValue::VT_int64:
+      return a.getInt64() == b.getInt64();
+    case AmqpTableValue::VT_float:
+      return a.getFloat() == b.getFloat();
+    case AmqpTableValue::VT_double:
+      return a.getDouble() == b.getDouble();
+    case AmqpTableValue::VT_string:
+      return a.getString() == b.getString();
+    case AmqpTableValue::VT_array: {
+      auto x = a.getArray();
+      auto y = b.getArray();
+      return x.size() == y.size() &&
+             std::equal(x.begin(), x.end(), y.begin(), [](auto& l, auto& r) {
+               return same(l, r);
+             });
+    }
+    case AmqpTableValue::VT_table:
+      return same(a.getTable(), b.getTable());
+    case AmqpTableValue::VT_uint8:
+      return a.getUint8() == b.getUint8();
+    case AmqpTableValue::VT_uint16:
+      return a.getUint16() == b.getUint16();
+    case AmqpTableValue::VT_uint32:
+      return a.getUint32() == b.getUint32();
+    case AmqpTableValue::VT_uint64:
+      return a.getUint64() == b.getUint64();
+  }
+  return false;
+}
+
+static bool
+same(const AmqpTable& a, const AmqpTable& b)
+{
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](auto& l, auto& r) {
+           return l.first == r.first && same(l.second, r.second);
+         });
+}
+
+/// Encodes @p p as a header frame does and decodes it with rabbitmq-c.
+static AmqpProperties
+round_trip(const AmqpProperties& p)
+{
+  std::string head;
+  std::string tail;
+  std::uint16_t flags = encode_basic_properties(p, head, tail);
+  if (p.correlation_id.has_value())
+    flags |= AMQP_BASIC_CORRELATION_ID_FLAG;
+  std::string encoded;
+  put_u16(encoded, flags);
+  encoded += head;
+  if (p.correlation_id.has_value())
+    put_shortstr(encoded, p.correlation_id.value());
+  encoded += tail;
+  CHECK(basic_properties_size(p) == encoded.size());
+
+  amqp_pool_t pool;
+  init_amqp_pool(&pool, 4096);
+  void* decoded = nullptr;
+  int status = amqp_decode_properties(
+    AMQP_BASIC_CLASS,
+    &pool,
+    amqp_bytes_t{ encoded.size(), (void*)encoded.data() },
+    &decoded);
+  CHECK(status == AMQP_STATUS_OK);
+  AmqpProperties result;
+  if (status == AMQP_STATUS_OK)
+    result = convert_to_amqp_properties(*(amqp_basic_properties_t*)decoded);
+  empty_amqp_pool(&pool);
+  return result;
+}
+
+static void
+test_properties()
+{
+  AmqpProperties empty;
+  auto none = round_trip(empty);
+  CHECK(!none.content_type.has_value());
+  CHECK(!none.headers.has_value());
+  CHECK(!none.correlation_id.has_value());
+
+  AmqpTable nested;
+  nested.insert(AmqpTableEntry("depth", AmqpTableValue(std::int32_t(2))));
+  AmqpTable headers;
+  headers.insert(
+    AmqpTableEntry("x-retry-count", AmqpTableValue(std::int64_t(3))));
+  headers.insert(AmqpTableEntry("x-claim-check", AmqpTableValue("blob-1")));
+  headers.insert(AmqpTableEntry("flag", AmqpTableValue(true)));
+  headers.insert(AmqpTableEntry("ratio", AmqpTableValue(0.25)));
+  headers.insert(AmqpTableEntry("nested", AmqpTableValue(nested)));
+  headers.insert(AmqpTableEntry(
+    "list",
+    AmqpTableValue(std::vector<AmqpTableValue>{
+      AmqpTableValue(std::uint8_t(7)), AmqpTableValue("seven") })));
+
+  AmqpProperties p;
+  p.content_type = "application/json";
+  p.content_encoding = "gzip";
+  p.headers = headers;
+  p.delivery_mode = 2;
+  p.priority = 5;
+  p.correlation_id = "42";
+  p.reply_to = "amq.rabbitmq.reply-to";
+  p.expiration = "60000";
+  p.message_id = "m-1";
+  p.timestamp = 1700000000;
+  p.type = "invoice";
+  p.user_id = "guest";
+  p.app_id = "test";
+  p.cluster_id = "";
+
+  auto q = round_trip(p);
+  CHECK(q.content_type == p.content_type);
+  CHECK(q.content_encoding == p.content_encoding);
+  CHECK(q.headers.has_value() && same(q.headers.value(), headers));
+  CHECK(q.delivery_mode == p.delivery_mode);
+  CHECK(q.priority == p.priority);
+  CHECK(q.correlation_id == p.correlation_id);
+  CHECK(q.reply_to == p.reply_to);
+  CHECK(q.expiration == p.expiration);
+  CHECK(q.message_id == p.message_id);
+  CHECK(q.timestamp == p.timestamp);
+  CHECK(q.type == p.type);
+  CHECK(q.user_id == p.user_id);
+  CHECK(q.app_id == p.app_id);
+  CHECK(q.cluster_id == p.cluster_id);
+
+  // the correlation id sits between the head and the tail
+  p.correlation_id.reset();
+  auto r = round_trip(p);
+  CHECK(!r.correlation_id.has_value());
+  CHECK(r.reply_to == p.reply_to);
+  CHECK(r.content_type == p.content_type);
+}
+
+static void
+test_rate_limit()
+{
+  MessageBroker::RateLimit limit(10, 2);
+  CHECK(limit.tryAcquire());
+  CHECK(limit.tryAcquire());
+  std::chrono::nanoseconds wait(0);
+  CHECK(!limit.tryAcquire(&wait));
+  CHECK(wait.count() > 0 && wait <= std::chrono::milliseconds(100));
+
+  // a refused token is not reserved
+  std::this_thread::sleep_for(wait);
+  CHECK(limit.tryAcquire());
+  CHECK(!limit.tryAcquire());
+}
+
+static void
+test_deduplicator()
+{
+  Deduplicator dedupe(std::chrono::seconds(1), 1000, 1e-6, 1);
+  CHECK(dedupe.acquire("a"));
+  // in flight on another consumer
+  CHECK(!dedupe.acquire("a"));
+  dedupe.release("a", true);
+  CHECK(!dedupe.acquire("a"));
+
+  // a failed delivery comes again
+  CHECK(dedupe.acquire("b"));
+  dedupe.release("b", false);
+  CHECK(dedupe.acquire("b"));
+  dedupe.release("b", true);
+
+  // "a" left the exact ring, the Bloom filters still know it for one to
+  // two windows
+  CHECK(!dedupe.acquire("a"));
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  CHECK(!dedupe.acquire("a"));
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  CHECK(dedupe.acquire("a"));
+  dedupe.release("a", false);
+}
+
+static void
+test_hot_keys()
+{
+  HotKeys keys(2, std::chrono::milliseconds(200));
+  for (int i = 0; i < 5; i++) {
+    keys.add("x");
+  }
+  for (int i = 0; i < 3; i++) {
+    keys.add("y");
+  }
+  keys.add("z");
+  // reported once the window is complete
+  CHECK(keys.top().empty());
+  std::this_thread::sleep_for(std::chrono::milliseconds(220));
+  auto top = keys.top();
+  CHECK(top.size() == 2);
+  if (top.size() == 2) {
+    CHECK(top[0].key == "x" && top[0].count == 5);
+    CHECK(top[1].key == "y" && top[1].count == 3);
+  }
+  // an idle window in between leaves nothing to report
+  std::this_thread::sleep_for(std::chrono::milliseconds(450));
+  CHECK(keys.top().empty());
+}
+
+static void
+test_fit_frames()
+{
+  std::array<std::uint64_t, 32> sizes{};
+  CHECK(fit_frames(sizes, 0, 131072) == std::make_pair(131072, 0));
+
+  // bodies below 1 KiB fit the smallest frame
+  sizes[10] = 100;
+  CHECK(fit_frames(sizes, 100, 131072) == std::make_pair(4096, 0));
+  // a header frame is never split
+  CHECK(fit_frames(sizes, 5000, 131072) == std::make_pair(8192, 0));
+
+  // the 99th percentile, capped by the broker's limit
+  sizes[20] = 100;
+  CHECK(fit_frames(sizes, 100, 131072) == std::make_pair(131072, 2097166));
+  CHECK(fit_frames(sizes, 100, 2 << 20) == std::make_pair(1052672, 2097166));
+  sizes[10] = 10000;
+  CHECK(fit_frames(sizes, 100, 131072) == std::make_pair(4096, 0));
+}
+
+static void
+test_topology()
+{
+  char path[] = "/tmp/message_broker_test_XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0)
+    return;
+  std::string ini = "[exchange orders]\n"
+                    "type=topic\n"
+                    "durable=true\n"
+                    "\n"
+                    "[queue orders.created]\n"
+                    "durable=true\n"
+                    "argument.x-message-ttl=60000\n"
+                    "argument.x-queue-mode=lazy\n"
+                    "\n"
+                    "[binding created]\n"
+                    "source=orders\n"
+                    "destination=orders.created\n"
+                    "routing_key=order.created\n"
+                    "\n"
+                    "[binding audit]\n"
+                    "source=orders\n"
+                    "destination=audit\n"
+                    "destination_type=exchange\n";
+  CHECK(write(fd, ini.data(), ini.size()) == ssize_t(ini.size()));
+  close(fd);
+
+  auto topology = MessageBroker::Topology::load(path);
+  CHECK(topology.exchanges.size() == 1);
+  CHECK(topology.queues.size() == 1);
+  CHECK(topology.bindings.size() == 2);
+  if (topology.exchanges.size() == 1) {
+    CHECK(topology.exchanges[0].name == "orders");
+    CHECK(topology.exchanges[0].type == "topic");
+    CHECK(topology.exchanges[0].durable);
+    CHECK(!topology.exchanges[0].auto_delete);
+  }
+  if (topology.queues.size() == 1) {
+    const auto& queue = topology.queues[0];
+    CHECK(queue.name == "orders.created");
+    CHECK(queue.durable);
+    CHECK(queue.arguments.has_value());
+    if (queue.arguments.has_value()) {
+      const auto& arguments = queue.arguments.value();
+      auto ttl = arguments.find("x-message-ttl");
+      CHECK(ttl != arguments.end() &&
+            ttl->second.getType() == AmqpTableValue::VT_int64 &&
+            ttl->second.getInt64() == 60000);
+      auto mode = arguments.find("x-queue-mode");
+      CHECK(mode != arguments.end() && mode->second.getString() == "lazy");
+    }
+  }
+  if (topology.bindings.size() == 2) {
+    CHECK(topology.bindings[0].source == "orders");
+    CHECK(topology.bindings[0].destination == "orders.created");
+    CHECK(!topology.bindings[0].exchange);
+    CHECK(topology.bindings[0].routing_key == "order.created");
+    CHECK(topology.bindings[1].exchange);
+  }
+
+  // unknown groups are refused
+  ini = "[stream orders]\n";
+  FILE* file = fopen(path, "w");
+  fputs(ini.c_str(), file);
+  fclose(file);
+  bool refused = false;
+  try {
+    MessageBroker::Topology::load(path);
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  CHECK(refused);
+  unlink(path);
+}
+
+int
+main()
+{
+  test_properties();
+  test_rate_limit();
+  test_deduplicator();
+  test_hot_keys();
+  test_fit_frames();
+  test_topology();
+
+  if (failures) {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "all checks passed" << std::endl;
+  return 0;
+}